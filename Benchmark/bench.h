@@ -0,0 +1,117 @@
+// Headless benchmark support shared by the ray tracers.
+//
+//   ./Ray_Tracing --headless --frames 300
+//
+// renders into an offscreen SDL_Surface instead of a window, moves the light
+// source along a fixed figure-eight path instead of following the mouse, and
+// prints per-frame latency percentiles plus ray and pixel throughput at exit.
+// --record PATH runs the same headless frames and also writes them to PATH
+// (see Recorder.h).
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <SDL2/SDL.h>
+
+#define BENCH_DEFAULT_FRAMES 300
+
+struct Bench {
+    int headless;
+    const char *record;
+    int frames;
+    int frame;
+    double *frame_ms;
+    double rays;
+    double pixels;
+    Uint64 frame_start;
+};
+
+// Returns 1 when --headless or --record was given. --frames N sets the frame count.
+static int bench_parse_args(struct Bench *bench, int argc, char *argv[]) {
+    memset(bench, 0, sizeof(*bench));
+    bench->frames = BENCH_DEFAULT_FRAMES;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            bench->headless = 1;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            bench->frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            bench->headless = 1;
+            bench->record = argv[++i];
+        }
+    }
+    if (bench->frames < 1) bench->frames = 1;
+    if (bench->headless) {
+        bench->frame_ms = (double *)calloc(bench->frames, sizeof(double));
+    }
+    return bench->headless;
+}
+
+// Offscreen target with the same 32-bit layout the tracers write into a window surface
+static SDL_Surface *bench_create_surface(int width, int height) {
+    return SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ARGB8888);
+}
+
+// Scripted light position for the current frame: one full figure-eight per run
+static void bench_light_position(struct Bench *bench, int width, int height, double *x, double *y) {
+    double t = 2 * M_PI * bench->frame / bench->frames;
+    *x = width / 2.0 + width * 0.4 * cos(t);
+    *y = height / 2.0 + height * 0.4 * sin(2 * t);
+}
+
+static int bench_running(struct Bench *bench) {
+    return bench->frame < bench->frames;
+}
+
+static void bench_frame_begin(struct Bench *bench) {
+    bench->frame_start = SDL_GetPerformanceCounter();
+}
+
+static void bench_frame_end(struct Bench *bench, double rays, double pixels) {
+    Uint64 elapsed = SDL_GetPerformanceCounter() - bench->frame_start;
+    bench->frame_ms[bench->frame] = 1000.0 * elapsed / SDL_GetPerformanceFrequency();
+    bench->rays += rays;
+    bench->pixels += pixels;
+    bench->frame++;
+}
+
+static int bench_compare_ms(const void *a, const void *b) {
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+// Nearest-rank percentile of a sorted array
+static double bench_percentile(const double *sorted, int count, double p) {
+    int rank = (int)ceil(p * count);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+static void bench_report(struct Bench *bench, const char *name) {
+    int count = bench->frame;
+    if (count == 0) return;
+
+    double total_ms = 0;
+    for (int i = 0; i < count; i++) total_ms += bench->frame_ms[i];
+    qsort(bench->frame_ms, count, sizeof(double), bench_compare_ms);
+
+    double seconds = total_ms / 1000.0;
+    printf("%s: %d frames, p50 %.3f ms, p99 %.3f ms, %.1f frames/s, %.3e rays/s, %.3e pixels/s\n",
+           name, count,
+           bench_percentile(bench->frame_ms, count, 0.50),
+           bench_percentile(bench->frame_ms, count, 0.99),
+           count / seconds, bench->rays / seconds, bench->pixels / seconds);
+}
+
+static void bench_free(struct Bench *bench) {
+    free(bench->frame_ms);
+    bench->frame_ms = NULL;
+}
+
+#endif
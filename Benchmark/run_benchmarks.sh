@@ -0,0 +1,34 @@
+#!/bin/sh
+# Builds every ray tracer and runs it headless with a scripted light path.
+#
+#   ./Benchmark/run_benchmarks.sh [frames] [extra args for the Full tracer]
+#
+# Run from the repository root. Binaries go to Benchmark/build/. Stops before
+# the benchmarks if the shading kernels disagree.
+
+FRAMES=${1:-300}
+shift 2>/dev/null
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+OUT=Benchmark/build
+
+mkdir -p "$OUT" || exit 1
+
+build() {
+    $CC $CFLAGS "$1" -o "$OUT/$2" -lSDL2 -lm || exit 1
+}
+
+build Ray_Tracing_Optimised.c Ray_Tracing_Optimised
+build Ray_Tracing_Unoptimised.c Ray_Tracing_Unoptimised
+build Ray_Tracing_Multiple_Objects/Ray_tracing.c Ray_Tracing_Multiple_Objects
+build "Full-Ray-Tracing-And-Shadow-Casting/Ray Tracing.c" Full_Ray_Tracing
+build Benchmark/shading_check.c shading_check
+
+"$OUT/shading_check" || exit 1
+
+"$OUT/Ray_Tracing_Optimised" --headless --frames "$FRAMES"
+"$OUT/Ray_Tracing_Unoptimised" --headless --frames "$FRAMES"
+"$OUT/Ray_Tracing_Multiple_Objects" --headless --frames "$FRAMES"
+"$OUT/Ray_Tracing_Optimised" --headless --frames "$FRAMES" --visibility
+"$OUT/Ray_Tracing_Multiple_Objects" --headless --frames "$FRAMES" --visibility
+"$OUT/Full_Ray_Tracing" --headless --frames "$FRAMES" "$@"
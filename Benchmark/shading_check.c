@@ -0,0 +1,115 @@
+// Checks the span shading kernels of Ray_Shading.h against each other.
+//
+//   ./shading_check [spans]
+//
+// Shades random spans from random light positions with the scalar, SSE2 and
+// AVX2 kernels (whichever this CPU runs) and fails on any color that differs
+// by even one bit. All three compute 1 / (d^2 + 1) from the same reciprocal
+// estimate and one Newton step, so they must agree exactly.
+//
+// That estimate is not IEEE division. The check also shades every span with a
+// true 1.0f / a and reports how far the kernels are from it: the largest
+// channel difference and how many colors differ at all. It fails when any
+// channel is off by more than SHADING_TOLERANCE levels.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <SDL2/SDL.h>
+#include "../Ray_Shading.h"
+#include "../Random.h"
+
+#define DEFAULT_SPANS 20000
+#define MAX_SPAN 2048
+#define SHADING_TOLERANCE 1     // 8-bit levels the estimate may differ from division by
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+// shade_span_scalar with IEEE division instead of the reciprocal estimate
+static void shade_span_divide(const struct Span_Light *light, float px, float py, float dx, float dy,
+                              int first, int count, Uint32 *colors) {
+    for (int i = 0; i < count; i++) {
+        float step = (float)(first + i);
+        float x = px + step * dx;
+        float y = py + step * dy;
+        float intensity = light->falloff / (x * x + y * y + 1.0f);
+        if (intensity > 1.0f) intensity = 1.0f;
+        if (intensity < light->cutoff) intensity = 0.0f;
+        colors[i] = ((Uint32)(light->r * intensity) << 16) |
+                    ((Uint32)(light->g * intensity) << 8) |
+                    (Uint32)(light->b * intensity);
+    }
+}
+
+static int channel_difference(Uint32 a, Uint32 b) {
+    int worst = 0;
+    for (int shift = 0; shift <= 16; shift += 8) {
+        int d = abs((int)((a >> shift) & 0xFF) - (int)((b >> shift) & 0xFF));
+        if (d > worst) worst = d;
+    }
+    return worst;
+}
+
+int main(int argc, char *argv[]) {
+    int spans = argc > 1 ? atoi(argv[1]) : DEFAULT_SPANS;
+
+    const char *names[3];
+    Shade_Span kernels[3];
+    int num_kernels = 0;
+    names[num_kernels] = "scalar";
+    kernels[num_kernels++] = shade_span_scalar;
+#ifdef RAY_SHADING_X86
+    names[num_kernels] = "sse2";
+    kernels[num_kernels++] = shade_span_sse2;
+    if (SDL_HasAVX2()) {
+        names[num_kernels] = "avx2";
+        kernels[num_kernels++] = shade_span_avx2;
+    }
+#endif
+
+    static Uint32 expected[MAX_SPAN], colors[MAX_SPAN], divided[MAX_SPAN];
+    long mismatches[3] = {0}, checked = 0, off_by_any = 0;
+    int worst = 0;
+    for (int s = 0; s < spans; s++) {
+        // Light colors, falloffs and cutoffs in the range the tracers use
+        Uint64 key = random_key(1, (Uint64)s);
+        Uint32 color = (Uint32)(random_uniform_keyed(key, 0) * 0x1000000);
+        double falloff = 1000.0 + random_uniform_keyed(key, 1) * 99000.0;
+        double cutoff = random_uniform_keyed(key, 2) * 0.1;
+        struct Span_Light light = span_light(color, falloff, cutoff);
+        float px = (float)(random_signed_keyed(key, 3) * 2000.0);
+        float py = (float)(random_signed_keyed(key, 4) * 2000.0);
+        double angle = random_uniform_keyed(key, 5) * 6.283185307179586;
+        float dx = (float)cos(angle), dy = (float)sin(angle);
+        int first = (int)(random_uniform_keyed(key, 6) * 100);
+        int count = (int)(random_uniform_keyed(key, 7) * MAX_SPAN);
+
+        kernels[0](&light, px, py, dx, dy, first, count, expected);
+        for (int k = 1; k < num_kernels; k++) {
+            kernels[k](&light, px, py, dx, dy, first, count, colors);
+            for (int i = 0; i < count; i++) {
+                if (colors[i] != expected[i]) mismatches[k]++;
+            }
+        }
+        shade_span_divide(&light, px, py, dx, dy, first, count, divided);
+        for (int i = 0; i < count; i++) {
+            int d = channel_difference(expected[i], divided[i]);
+            if (d > 0) off_by_any++;
+            if (d > worst) worst = d;
+        }
+        checked += count;
+    }
+
+    int failed = 0;
+    for (int k = 1; k < num_kernels; k++) {
+        printf("%-6s vs scalar: %ld of %ld colors differ\n", names[k], mismatches[k], checked);
+        if (mismatches[k] > 0) failed = 1;
+    }
+    printf("scalar vs division: %ld of %ld colors differ, by at most %d level%s\n",
+           off_by_any, checked, worst, worst == 1 ? "" : "s");
+    if (worst > SHADING_TOLERANCE) failed = 1;
+    printf("%s\n", failed ? "FAILED" : "OK");
+    return failed;
+}
@@ -1,17 +1,39 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <SDL2/SDL.h>
 #include <time.h>
+#include "../Benchmark/bench.h"
+#include "../Ray_Directions.h"
+#include "../Ray_Shading.h"
+#include "../Recorder.h"
+#include "../Profiler.h"
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 #define WIDTH 1600
 #define HEIGHT 800
 #define COLOR_WHITE 0xffffffff
 #define COLOR_BLACK 0x00000000
 #define COLOR_SOURCE 0xffffffff
-#define COLOR_REFLECTION 0xffffffff
 #define RAYS_NUMBER 8000
-#define MAX_SHADOWS 10
-#define MAX_BOUNCES 2
+#define MAX_LIGHTS 8
+#define SECONDARY_INTENSITY 0.5
+#define LIGHT_FALLOFF 20000.0
+#define LIGHT_CUTOFF 0.01
+#define DEFAULT_SHADOWS 5
+#define MAX_MOVED_OBSTACLES 8
+#define BVH_LEAF_SIZE 4
+#define BVH_STACK_SIZE 64
+#define BVH_REBUILD_FRAMES 120
+#define OBSTACLE_SEED 12345
+#define DEFAULT_BOUNCES 2
+#define MAX_STEPS 2000
+#define MAX_THREADS 64
+#define EXPOSURE 2.0f
 
 struct Circle {
     double x;
@@ -19,6 +41,14 @@ struct Circle {
     double r;
 };
 
+// A point light. Its rays and their reflections carry its color, and intensity
+// scales the falloff, so a dimmer light also reaches less far.
+struct Light_Source {
+    struct Circle circle;
+    Uint32 color;
+    double intensity;
+};
+
 struct Ray {
     double x_start, y_start;
     double dx, dy;
@@ -26,6 +56,67 @@ struct Ray {
     int bounce_count;
 };
 
+struct Hit_Window {
+    int object;
+    int first_step, last_step;
+};
+
+// One straight piece of a traced ray: it starts at (x, y) and wrote pixels
+// for the first `steps` steps along (dx, dy)
+struct Ray_Segment {
+    double x, y;
+    double dx, dy;
+    int steps;
+};
+
+// Segments of one primary ray and its reflections, room for one per bounce
+struct Ray_Path {
+    int num_segments;
+    struct Ray_Segment *segments;
+};
+
+// A ray waiting in a wavefront queue. index is the primary ray it came from,
+// which sets the attenuation origin and the path it records into. A ray that
+// hits a mirror keeps the hit point until it is reflected.
+struct Queued_Ray {
+    struct Ray ray;
+    int index;
+    double hit_x, hit_y;
+    int object;
+};
+
+// The current bounce generation and the survivors for the next one, plus
+// scratch space for the hit windows, pixels and colors of the segment being marched
+struct Wavefront {
+    struct Queued_Ray *current, *next;
+    int num_current, num_next;
+    struct Hit_Window *windows;
+    int window_capacity;
+    int *offsets;
+    Uint32 *colors;
+};
+
+// Bounding volume hierarchy over the obstacles. Nodes are stored parent before
+// children, so a refit only has to walk the array backwards.
+struct BVH_Node {
+    double min_x, min_y, max_x, max_y;
+    int left, right;            // children, -1 for a leaf
+    int first, count;           // the leaf's range of items
+};
+
+struct BVH {
+    struct BVH_Node *nodes;
+    int *items;
+    int num_nodes;
+    int num_objects;
+};
+
+// Light gathered per color channel before tone mapping. Rays add into it with
+// saturating integer adds, which give the same sum in any order.
+struct Light_Buffer {
+    Uint16 *r, *g, *b;
+};
+
 void FillCircle_Outline(SDL_Surface *surface, struct Circle circle, Uint32 color) {
     int x0 = (int)circle.x;
     int y0 = (int)circle.y;
@@ -44,12 +135,24 @@ void FillCircle_Outline(SDL_Surface *surface, struct Circle circle, Uint32 color
     }
 }
 
+// Directions come from the shared table, so moving the source only changes the origin.
+// Without a table (out of memory) the angles are computed per ray.
 void generate_rays(struct Circle circle, struct Ray rays[RAYS_NUMBER]) {
+    PROFILE_SCOPE("generate");
+    const struct Ray_Directions *directions = ray_directions(RAYS_NUMBER);
     for (int i = 0; i < RAYS_NUMBER; i++) {
-        double angle = ((double)i / RAYS_NUMBER) * 2 * M_PI;
+        double dx, dy;
+        if (directions) {
+            dx = directions->dx[i];
+            dy = directions->dy[i];
+        } else {
+            double angle = ((double)i / RAYS_NUMBER) * 2 * M_PI;
+            dx = cos(angle);
+            dy = sin(angle);
+        }
         rays[i] = (struct Ray){
             circle.x, circle.y,
-            cos(angle), sin(angle),
+            dx, dy,
             1.0,
             0
         };
@@ -63,6 +166,258 @@ int RayIntersectsCircle(double x, double y, struct Circle circle) {
     return distance_sq <= (circle.r * circle.r);
 }
 
+// Solves |p + t*d - c|^2 = r^2 for the ray segment and turns the roots into the
+// range of march steps that can land inside the circle. The range is padded by
+// a small epsilon so the exact per-step test still decides the hit and the
+// rasterized output stays identical to marching against every circle.
+int RayCircleStepWindow(double x, double y, double dx, double dy, struct Circle circle,
+                        int min_step, int max_step, struct Hit_Window *window) {
+    double fx = x - circle.x;
+    double fy = y - circle.y;
+    double r = circle.r + 1e-3;
+    double a = dx * dx + dy * dy;
+    double b = 2 * (fx * dx + fy * dy);
+    double c = fx * fx + fy * fy - r * r;
+    double disc = b * b - 4 * a * c;
+    if (a == 0 || disc < 0) return 0;
+
+    double root = sqrt(disc);
+    double t_enter = floor((-b - root) / (2 * a) - 1e-6);
+    double t_exit = ceil((-b + root) / (2 * a) + 1e-6);
+    if (t_exit < min_step || t_enter > max_step) return 0;
+
+    window->first_step = t_enter < min_step ? min_step : (int)t_enter;
+    window->last_step = t_exit > max_step ? max_step : (int)t_exit;
+    return 1;
+}
+
+// Leaves hold the circles' own bounds, inner nodes the union of their children
+void RefitBVH(struct BVH *bvh, const struct Circle objects[]) {
+    for (int n = bvh->num_nodes - 1; n >= 0; n--) {
+        struct BVH_Node *node = &bvh->nodes[n];
+        if (node->left < 0) {
+            node->min_x = node->min_y = INFINITY;
+            node->max_x = node->max_y = -INFINITY;
+            for (int i = node->first; i < node->first + node->count; i++) {
+                struct Circle c = objects[bvh->items[i]];
+                node->min_x = fmin(node->min_x, c.x - c.r);
+                node->min_y = fmin(node->min_y, c.y - c.r);
+                node->max_x = fmax(node->max_x, c.x + c.r);
+                node->max_y = fmax(node->max_y, c.y + c.r);
+            }
+        } else {
+            struct BVH_Node *a = &bvh->nodes[node->left], *b = &bvh->nodes[node->right];
+            node->min_x = fmin(a->min_x, b->min_x);
+            node->min_y = fmin(a->min_y, b->min_y);
+            node->max_x = fmax(a->max_x, b->max_x);
+            node->max_y = fmax(a->max_y, b->max_y);
+        }
+    }
+}
+
+static double CircleCenter(struct Circle c, int axis) {
+    return axis == 0 ? c.x : c.y;
+}
+
+// Quickselect: moves the item with the k-th smallest center along axis to items[k],
+// smaller ones before it and larger ones after it
+static void SelectItems(int *items, int count, int k, const struct Circle objects[], int axis) {
+    int lo = 0, hi = count - 1;
+    while (lo < hi) {
+        double pivot = CircleCenter(objects[items[(lo + hi) / 2]], axis);
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (CircleCenter(objects[items[i]], axis) < pivot) i++;
+            while (CircleCenter(objects[items[j]], axis) > pivot) j--;
+            if (i <= j) {
+                int swap = items[i];
+                items[i] = items[j];
+                items[j] = swap;
+                i++;
+                j--;
+            }
+        }
+        if (k <= j) hi = j;
+        else if (k >= i) lo = i;
+        else break;
+    }
+}
+
+static int BuildBVHNode(struct BVH *bvh, const struct Circle objects[], int first, int count) {
+    int index = bvh->num_nodes++;
+    struct BVH_Node *node = &bvh->nodes[index];
+    node->first = first;
+    node->count = count;
+    node->left = node->right = -1;
+    if (count <= BVH_LEAF_SIZE) return index;
+
+    // Median split across the wider spread of centers keeps the tree balanced
+    double min_x = INFINITY, min_y = INFINITY, max_x = -INFINITY, max_y = -INFINITY;
+    for (int i = first; i < first + count; i++) {
+        struct Circle c = objects[bvh->items[i]];
+        min_x = fmin(min_x, c.x);
+        min_y = fmin(min_y, c.y);
+        max_x = fmax(max_x, c.x);
+        max_y = fmax(max_y, c.y);
+    }
+    int axis = (max_x - min_x) >= (max_y - min_y) ? 0 : 1;
+    int half = count / 2;
+    SelectItems(bvh->items + first, count, half, objects, axis);
+
+    int left = BuildBVHNode(bvh, objects, first, half);
+    int right = BuildBVHNode(bvh, objects, first + half, count - half);
+    bvh->nodes[index].left = left;
+    bvh->nodes[index].right = right;
+    bvh->nodes[index].count = 0;
+    return index;
+}
+
+int BuildBVH(struct BVH *bvh, const struct Circle objects[], int num_objects) {
+    free(bvh->nodes);
+    free(bvh->items);
+    bvh->nodes = malloc((2 * num_objects + 1) * sizeof(struct BVH_Node));
+    bvh->items = malloc((num_objects + 1) * sizeof(int));
+    bvh->num_nodes = 0;
+    bvh->num_objects = num_objects;
+    if (bvh->nodes == NULL || bvh->items == NULL) return -1;
+
+    for (int i = 0; i < num_objects; i++) bvh->items[i] = i;
+    BuildBVHNode(bvh, objects, 0, num_objects);
+    RefitBVH(bvh, objects);
+    return 0;
+}
+
+void FreeBVH(struct BVH *bvh) {
+    free(bvh->nodes);
+    free(bvh->items);
+    bvh->nodes = NULL;
+    bvh->items = NULL;
+}
+
+// Step range [t_enter, t_exit] where the ray is inside the node's box
+static int RayBoxSteps(const struct BVH_Node *node, double x, double y, double dx, double dy,
+                       double *t_enter, double *t_exit) {
+    double t0 = -INFINITY, t1 = INFINITY;
+    if (dx != 0) {
+        double a = (node->min_x - x) / dx, b = (node->max_x - x) / dx;
+        t0 = fmax(t0, fmin(a, b));
+        t1 = fmin(t1, fmax(a, b));
+    } else if (x < node->min_x || x > node->max_x) {
+        return 0;
+    }
+    if (dy != 0) {
+        double a = (node->min_y - y) / dy, b = (node->max_y - y) / dy;
+        t0 = fmax(t0, fmin(a, b));
+        t1 = fmin(t1, fmax(a, b));
+    } else if (y < node->min_y || y > node->max_y) {
+        return 0;
+    }
+    *t_enter = t0;
+    *t_exit = t1;
+    return t0 <= t1;
+}
+
+// First march step that is certain to land inside the circle, or 0 when the
+// segment only grazes it and the per-step test might step over it
+static int RayCircleSureHit(double x, double y, double dx, double dy, struct Circle circle) {
+    double fx = x - circle.x;
+    double fy = y - circle.y;
+    double a = dx * dx + dy * dy;
+    double b = 2 * (fx * dx + fy * dy);
+    double c = fx * fx + fy * fy - circle.r * circle.r;
+    double disc = b * b - 4 * a * c;
+    if (a == 0 || disc < 0) return 0;
+
+    double root = sqrt(disc);
+    double t_enter = (-b - root) / (2 * a);
+    double t_exit = (-b + root) / (2 * a);
+    double step = fmax(1.0, floor(t_enter) + 1);
+    if (step - t_enter < 1e-3 || t_exit - step < 1e-3 || step > MAX_STEPS) return 0;
+    return (int)step;
+}
+
+static void PushWindow(struct Wavefront *wave, int *num_windows, struct Hit_Window window) {
+    if (*num_windows == wave->window_capacity) {
+        int capacity = wave->window_capacity ? 2 * wave->window_capacity : 64;
+        struct Hit_Window *windows = realloc(wave->windows, capacity * sizeof(struct Hit_Window));
+        if (windows == NULL) return;
+        wave->windows = windows;
+        wave->window_capacity = capacity;
+    }
+    wave->windows[(*num_windows)++] = window;
+}
+
+// Collects into wave->windows the step windows of every circle the segment can
+// stop at, sorted by first step. Boxes are visited nearest first, and a circle
+// the segment crosses deeply enough is certain to stop the march, so nothing
+// behind it needs to be looked at. Returns the number of windows.
+int CollectHitWindows(struct Wavefront *wave, const struct BVH *bvh, const struct Circle objects[],
+                      double x, double y, double dx, double dy) {
+    int num_windows = 0;
+    if (bvh->num_objects == 0) return 0;
+
+    int limit = MAX_STEPS;
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const struct BVH_Node *node = &bvh->nodes[stack[--top]];
+        double t_enter, t_exit;
+        // A step of slack covers the padding and rounding of the step windows
+        if (!RayBoxSteps(node, x, y, dx, dy, &t_enter, &t_exit) || t_exit < 0 || t_enter > limit + 1) {
+            continue;
+        }
+
+        if (node->left < 0) {
+            for (int i = node->first; i < node->first + node->count; i++) {
+                int k = bvh->items[i];
+                struct Hit_Window window;
+                if (!RayCircleStepWindow(x, y, dx, dy, objects[k], 1, limit, &window)) continue;
+                window.object = k;
+                PushWindow(wave, &num_windows, window);
+                int sure = RayCircleSureHit(x, y, dx, dy, objects[k]);
+                if (sure > 0 && sure < limit) limit = sure;
+            }
+            continue;
+        }
+
+        // Push the far child first so the near one is visited next
+        const struct BVH_Node *left = &bvh->nodes[node->left], *right = &bvh->nodes[node->right];
+        double left_enter, left_exit, right_enter, right_exit;
+        int hit_left = RayBoxSteps(left, x, y, dx, dy, &left_enter, &left_exit);
+        int hit_right = RayBoxSteps(right, x, y, dx, dy, &right_enter, &right_exit);
+        int near = node->left, far = node->right;
+        if (hit_left && hit_right && right_enter < left_enter) {
+            near = node->right;
+            far = node->left;
+        }
+        if (top + 2 > BVH_STACK_SIZE) continue;
+        if (hit_left && hit_right) {
+            stack[top++] = far;
+            stack[top++] = near;
+        } else if (hit_left) {
+            stack[top++] = node->left;
+        } else if (hit_right) {
+            stack[top++] = node->right;
+        }
+    }
+
+    // Drop what lies past the final limit and order the rest along the ray
+    int kept = 0;
+    for (int i = 0; i < num_windows; i++) {
+        struct Hit_Window w = wave->windows[i];
+        if (w.first_step > limit) continue;
+        if (w.last_step > limit) w.last_step = limit;
+        int j = kept++;
+        while (j > 0 && wave->windows[j - 1].first_step > w.first_step) {
+            wave->windows[j] = wave->windows[j - 1];
+            j--;
+        }
+        wave->windows[j] = w;
+    }
+    return kept;
+}
+
 void handle_reflection(struct Ray* ray, double hit_x, double hit_y, struct Circle circle) {
     // Calculate surface normal (vector from circle center to hit point)
     double nx = (hit_x - circle.x) / circle.r;
@@ -102,132 +457,931 @@ void handle_reflection(struct Ray* ray, double hit_x, double hit_y, struct Circl
     ray->bounce_count++;
 }
 
-void FillRays(SDL_Surface *surface, struct Ray rays[RAYS_NUMBER], 
-              struct Circle objects[], int num_objects, Uint32 baseColor) {
+int CreateLightBuffer(struct Light_Buffer *light) {
+    light->r = calloc(3 * WIDTH * HEIGHT, sizeof(Uint16));
+    if (light->r == NULL) return -1;
+    light->g = light->r + WIDTH * HEIGHT;
+    light->b = light->g + WIDTH * HEIGHT;
+    return 0;
+}
+
+void FreeLightBuffer(struct Light_Buffer *light) {
+    free(light->r);
+    light->r = light->g = light->b = NULL;
+}
+
+void ClearLight(struct Light_Buffer *light, SDL_Rect area) {
+    for (int y = area.y; y < area.y + area.h; y++) {
+        int index = y * WIDTH + area.x;
+        memset(light->r + index, 0, area.w * sizeof(Uint16));
+        memset(light->g + index, 0, area.w * sizeof(Uint16));
+        memset(light->b + index, 0, area.w * sizeof(Uint16));
+    }
+}
+
+static inline Uint16 AddLight(Uint16 existing, Uint32 amount) {
+    Uint32 sum = existing + amount;
+    return sum > 0xFFFF ? 0xFFFF : (Uint16)sum;
+}
+
+void AddLightRow(Uint16 *dst, const Uint16 *src, int count) {
+    int x = 0;
+#ifdef HAVE_X86_SIMD
+    for (; x + 8 <= count; x += 8) {
+        __m128i sum = _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(dst + x)),
+                                     _mm_loadu_si128((const __m128i *)(src + x)));
+        _mm_storeu_si128((__m128i *)(dst + x), sum);
+    }
+#endif
+    for (; x < count; x++) {
+        dst[x] = AddLight(dst[x], src[x]);
+    }
+}
+
+// Reinhard curve x / (1 + x) on the exposed channel value
+static inline Uint32 ToneMap(Uint16 value) {
+    float x = value * (EXPOSURE / 255.0f);
+    return (Uint32)(x / (1.0f + x) * 255.0f);
+}
+
+#ifdef HAVE_X86_SIMD
+// Same float operations in the same order as ToneMap, four channels at a time
+static inline __m128i ToneMap_SSE2(__m128i value) {
+    __m128 x = _mm_mul_ps(_mm_cvtepi32_ps(value), _mm_set1_ps(EXPOSURE / 255.0f));
+    __m128 y = _mm_mul_ps(_mm_div_ps(x, _mm_add_ps(_mm_set1_ps(1.0f), x)), _mm_set1_ps(255.0f));
+    return _mm_cvttps_epi32(y);
+}
+#endif
+
+// Tone maps the gathered light inside area into the surface
+void ResolveLight(const struct Light_Buffer *light, SDL_Surface *surface, SDL_Rect area) {
     Uint32 *pixels = (Uint32 *)surface->pixels;
     int pitch = surface->pitch / 4;
+    for (int y = area.y; y < area.y + area.h; y++) {
+        const Uint16 *r = light->r + y * WIDTH;
+        const Uint16 *g = light->g + y * WIDTH;
+        const Uint16 *b = light->b + y * WIDTH;
+        Uint32 *row = pixels + y * pitch;
+        int x = area.x, end = area.x + area.w;
+#ifdef HAVE_X86_SIMD
+        __m128i zero = _mm_setzero_si128();
+        for (; x + 8 <= end; x += 8) {
+            __m128i r8 = _mm_loadu_si128((const __m128i *)(r + x));
+            __m128i g8 = _mm_loadu_si128((const __m128i *)(g + x));
+            __m128i b8 = _mm_loadu_si128((const __m128i *)(b + x));
+            __m128i lo = _mm_or_si128(_mm_or_si128(
+                             _mm_slli_epi32(ToneMap_SSE2(_mm_unpacklo_epi16(r8, zero)), 16),
+                             _mm_slli_epi32(ToneMap_SSE2(_mm_unpacklo_epi16(g8, zero)), 8)),
+                             ToneMap_SSE2(_mm_unpacklo_epi16(b8, zero)));
+            __m128i hi = _mm_or_si128(_mm_or_si128(
+                             _mm_slli_epi32(ToneMap_SSE2(_mm_unpackhi_epi16(r8, zero)), 16),
+                             _mm_slli_epi32(ToneMap_SSE2(_mm_unpackhi_epi16(g8, zero)), 8)),
+                             ToneMap_SSE2(_mm_unpackhi_epi16(b8, zero)));
+            _mm_storeu_si128((__m128i *)(row + x), lo);
+            _mm_storeu_si128((__m128i *)(row + x + 4), hi);
+        }
+#endif
+        for (; x < end; x++) {
+            row[x] = (ToneMap(r[x]) << 16) | (ToneMap(g[x]) << 8) | ToneMap(b[x]);
+        }
+    }
+}
 
-    for (int i = 0; i < RAYS_NUMBER; i++) {
-        struct Ray current_ray = rays[i];
+int CreateWavefront(struct Wavefront *wave) {
+    wave->current = malloc(RAYS_NUMBER * sizeof(struct Queued_Ray));
+    wave->next = malloc(RAYS_NUMBER * sizeof(struct Queued_Ray));
+    wave->num_current = wave->num_next = 0;
+    wave->windows = NULL;
+    wave->window_capacity = 0;
+    wave->offsets = malloc(MAX_STEPS * sizeof(int));
+    wave->colors = malloc(MAX_STEPS * sizeof(Uint32));
+    return wave->current == NULL || wave->next == NULL ||
+           wave->offsets == NULL || wave->colors == NULL ? -1 : 0;
+}
+
+void FreeWavefront(struct Wavefront *wave) {
+    free(wave->current);
+    free(wave->next);
+    free(wave->windows);
+    free(wave->offsets);
+    free(wave->colors);
+}
+
+// Adds a primary ray to the first generation and starts its path
+void QueueRay(struct Wavefront *wave, struct Ray rays[RAYS_NUMBER], int index, struct Ray_Path paths[]) {
+    struct Queued_Ray *queued = &wave->current[wave->num_current++];
+    queued->ray = rays[index];
+    queued->index = index;
+    if (paths) paths[index].num_segments = 0;
+}
+
+// Marches one ray segment into a light buffer and returns the number of pixels
+// written. Light is summed, so tracing disjoint sets of rays into separate
+// buffers and adding them together gives exactly the same image as tracing
+// them all into one buffer. Only pixels inside clip are written (NULL writes
+// everywhere). Returns with queued->object set to the mirror that was hit, or -1.
+long TraceSegment(struct Light_Buffer *light, struct Wavefront *wave, struct Queued_Ray *queued,
+                  struct Ray origin, struct Circle objects[], const struct BVH *bvh,
+                  const struct Light_Source *source, const SDL_Rect *clip, struct Ray_Segment *segment) {
+    long pixels_written = 0;
+    struct Ray current_ray = queued->ray;
+    double x = current_ray.x_start;
+    double y = current_ray.y_start;
+    queued->object = -1;
+    if (segment) *segment = (struct Ray_Segment){x, y, current_ray.dx, current_ray.dy, 0};
+
+    // Only circles the segment actually reaches need the per-step test
+    int num_windows = CollectHitWindows(wave, bvh, objects, x, y, current_ray.dx, current_ray.dy);
+    struct Hit_Window *windows = wave->windows;
+    int next_test = num_windows > 0 ? windows[0].first_step : MAX_STEPS + 1;
+
+    // Reflections keep the color of the light they came from. The march only
+    // decides which pixels the segment covers; they are shaded together after.
+    double strength = current_ray.intensity * source->intensity * LIGHT_FALLOFF;
+    double reach = strength / LIGHT_CUTOFF;
+    int *offsets = wave->offsets;
+    int num_steps = 0;
+
+    for (int step = 1; step <= MAX_STEPS; step++) {
+        // Advance ray
+        x += current_ray.dx;
+        y += current_ray.dy;
         
-        // Process ray through multiple bounces
-        while (current_ray.bounce_count < MAX_BOUNCES && current_ray.intensity > 0.1) {
-            double x = current_ray.x_start;
-            double y = current_ray.y_start;
-            int hit_occurred = 0;
-            
-            // Trace current ray segment
-            for (int step = 0; step < 2000; step++) {
-                // Advance ray
-                x += current_ray.dx;
-                y += current_ray.dy;
-                
-                // Boundary check
-                if (x < 0 || x >= WIDTH || y < 0 || y >= HEIGHT) break;
-                
-                // Calculate distance-based attenuation
-                double dist_sq = (x - rays[i].x_start)*(x - rays[i].x_start)
-                               + (y - rays[i].y_start)*(y - rays[i].y_start);
-                double intensity = current_ray.intensity * 20000.0 / (dist_sq + 1);
-                
-                // Apply minimum intensity threshold
-                if (intensity < 0.01) break;
-                intensity = fmin(intensity, 1.0);
-                
-                // Determine color based on bounce count
-                Uint32 color = baseColor;
-                if (current_ray.bounce_count > 0) {
-                    color = COLOR_REFLECTION;
-                }
-                
-                // Extract RGB components
-                Uint32 r = (color >> 16) & 0xFF;
-                Uint32 g = (color >> 8) & 0xFF;
-                Uint32 b = color & 0xFF;
-                
-                // Apply intensity to color
-                Uint32 final_color = 
-                    ((Uint32)(r * intensity) << 16) |
-                    ((Uint32)(g * intensity) << 8) |
-                    (Uint32)(b * intensity);
-                
-                // Blend with existing pixel color
-                Uint32 existing = pixels[(int)y * pitch + (int)x];
-                Uint32 blended = (existing | final_color);
-                pixels[(int)y * pitch + (int)x] = blended;
-                
-                // Check for collisions with objects
-                for (int k = 0; k < num_objects; k++) {
-                    if (RayIntersectsCircle(x, y, objects[k])) {
-                        handle_reflection(&current_ray, x, y, objects[k]);
-                        hit_occurred = 1;
-                        break;
-                    }
+        // Boundary check
+        if (x < 0 || x >= WIDTH || y < 0 || y >= HEIGHT) break;
+        
+        // Stop once the light falls below the cutoff, strength / (d^2 + 1) < LIGHT_CUTOFF
+        double dist_sq = (x - origin.x_start)*(x - origin.x_start)
+                       + (y - origin.y_start)*(y - origin.y_start);
+        if (dist_sq + 1 > reach) break;
+        if (segment) segment->steps = step;
+        
+        // Pixels outside clip are marched but not lit
+        int ix = (int)x, iy = (int)y;
+        int inside = clip == NULL || (ix >= clip->x && ix < clip->x + clip->w &&
+                                      iy >= clip->y && iy < clip->y + clip->h);
+        offsets[num_steps++] = inside ? iy * WIDTH + ix : -1;
+        
+        // Check for collisions with the circles whose window covers this step.
+        // Overlapping circles resolve to the lowest index, whatever the tree order.
+        if (step < next_test) continue;
+        int hit = -1;
+        for (int k = 0; k < num_windows && windows[k].first_step <= step; k++) {
+            struct Hit_Window w = windows[k];
+            if (step <= w.last_step && (hit < 0 || w.object < hit) &&
+                RayIntersectsCircle(x, y, objects[w.object])) {
+                hit = w.object;
+            }
+        }
+        if (hit >= 0) {
+            queued->hit_x = x;
+            queued->hit_y = y;
+            queued->object = hit;
+            break;
+        }
+    }
+
+    // Add the attenuated color of every covered step to its pixel's light
+    struct Span_Light span = span_light(source->color, strength, 0.0);
+    ray_shading_kernel()(&span, (float)(current_ray.x_start - origin.x_start),
+                         (float)(current_ray.y_start - origin.y_start),
+                         (float)current_ray.dx, (float)current_ray.dy, 1, num_steps, wave->colors);
+    for (int k = 0; k < num_steps; k++) {
+        int index = offsets[k];
+        if (index < 0) continue;
+        Uint32 color = wave->colors[k];
+        light->r[index] = AddLight(light->r[index], (color >> 16) & 0xFF);
+        light->g[index] = AddLight(light->g[index], (color >> 8) & 0xFF);
+        light->b[index] = AddLight(light->b[index], color & 0xFF);
+        pixels_written++;
+    }
+    return pixels_written;
+}
+
+// Traces the queued rays one bounce generation at a time. Every generation is
+// marched as a batch; the rays that hit a mirror are compacted into the next
+// queue, reflected together, and traced in the next pass while they are still
+// bright enough and below max_bounces. The cost follows the surviving rays
+// rather than the worst case depth. Returns the number of pixels written.
+long TraceWavefront(struct Light_Buffer *light, struct Wavefront *wave, struct Ray rays[RAYS_NUMBER],
+                    struct Circle objects[], const struct BVH *bvh, const struct Light_Source *source,
+                    int max_bounces, const SDL_Rect *clip, struct Ray_Path paths[]) {
+    PROFILE_SCOPE("trace");
+    long pixels_written = 0;
+    while (wave->num_current > 0) {
+        wave->num_next = 0;
+        for (int i = 0; i < wave->num_current; i++) {
+            struct Queued_Ray *queued = &wave->current[i];
+            if (queued->ray.bounce_count >= max_bounces || queued->ray.intensity <= 0.1) continue;
+
+            struct Ray_Segment *segment = NULL;
+            if (paths) {
+                struct Ray_Path *path = &paths[queued->index];
+                segment = &path->segments[path->num_segments++];
+            }
+            pixels_written += TraceSegment(light, wave, queued, rays[queued->index], objects, bvh,
+                                           source, clip, segment);
+            if (queued->object >= 0) wave->next[wave->num_next++] = *queued;
+        }
+
+        for (int i = 0; i < wave->num_next; i++) {
+            struct Queued_Ray *queued = &wave->next[i];
+            handle_reflection(&queued->ray, queued->hit_x, queued->hit_y, objects[queued->object]);
+        }
+
+        struct Queued_Ray *swap = wave->current;
+        wave->current = wave->next;
+        wave->next = swap;
+        wave->num_current = wave->num_next;
+    }
+    return pixels_written;
+}
+
+// Traces rays [first_ray, last_ray) and records their paths when paths is given
+long TraceRays(struct Light_Buffer *light, struct Wavefront *wave, struct Ray rays[RAYS_NUMBER],
+               int first_ray, int last_ray, struct Circle objects[], const struct BVH *bvh,
+               const struct Light_Source *source, int max_bounces, struct Ray_Path paths[]) {
+    wave->num_current = 0;
+    for (int i = first_ray; i < last_ray; i++) {
+        QueueRay(wave, rays, i, paths);
+    }
+    return TraceWavefront(light, wave, rays, objects, bvh, source, max_bounces, NULL, paths);
+}
+
+long FillRays(struct Light_Buffer *light, struct Wavefront *wave, struct Ray rays[RAYS_NUMBER],
+              struct Ray_Path paths[], struct Circle objects[], const struct BVH *bvh,
+              const struct Light_Source *source, int max_bounces) {
+    return TraceRays(light, wave, rays, 0, RAYS_NUMBER, objects, bvh, source, max_bounces, paths);
+}
+
+struct Render_Pool;
+
+struct Render_Worker {
+    SDL_Thread *thread;
+    SDL_sem *start;
+    struct Light_Buffer buffer;
+    struct Wavefront wave;
+    int first_ray, last_ray;
+    int first_row, last_row;
+    long pixels_written;
+    struct Render_Pool *pool;
+};
+
+// Persistent worker threads. Each frame runs in two phases: every worker traces
+// its slice of the rays into a private buffer, then every worker adds one band of
+// rows from all private buffers into the target and clears them for the next frame.
+struct Render_Pool {
+    int num_threads;
+    int phase;
+    SDL_sem *done;
+    struct Render_Worker workers[MAX_THREADS];
+
+    struct Light_Buffer *target;
+    struct Ray *rays;
+    struct Ray_Path *paths;
+    struct Circle *objects;
+    const struct BVH *bvh;
+    const struct Light_Source *source;
+    int max_bounces;
+};
+
+enum { PHASE_TRACE, PHASE_REDUCE, PHASE_QUIT };
+
+int RenderWorker(void *data) {
+    struct Render_Worker *worker = (struct Render_Worker *)data;
+    struct Render_Pool *pool = worker->pool;
+
+    while (1) {
+        SDL_SemWait(worker->start);
+        if (pool->phase == PHASE_QUIT) break;
+
+        if (pool->phase == PHASE_TRACE) {
+            worker->pixels_written = TraceRays(&worker->buffer, &worker->wave, pool->rays,
+                      worker->first_ray, worker->last_ray, pool->objects, pool->bvh,
+                      pool->source, pool->max_bounces, pool->paths);
+        } else {
+            PROFILE_SCOPE("reduce");
+            struct Light_Buffer *target = pool->target;
+            SDL_Rect band = {0, worker->first_row, WIDTH, worker->last_row - worker->first_row};
+            for (int t = 0; t < pool->num_threads; t++) {
+                struct Light_Buffer *src = &pool->workers[t].buffer;
+                for (int y = band.y; y < band.y + band.h; y++) {
+                    AddLightRow(target->r + y * WIDTH, src->r + y * WIDTH, WIDTH);
+                    AddLightRow(target->g + y * WIDTH, src->g + y * WIDTH, WIDTH);
+                    AddLightRow(target->b + y * WIDTH, src->b + y * WIDTH, WIDTH);
                 }
-                
-                if (hit_occurred) break;
+                ClearLight(src, band);
             }
-            
-            if (!hit_occurred) break;
         }
+        SDL_SemPost(pool->done);
+    }
+    return 0;
+}
+
+int CreateRenderPool(struct Render_Pool *pool, int num_threads) {
+    if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+    pool->num_threads = num_threads;
+    pool->phase = PHASE_TRACE;
+    pool->done = SDL_CreateSemaphore(0);
+    if (pool->done == NULL) {
+        pool->num_threads = 0;
+        return -1;
+    }
+
+    for (int t = 0; t < num_threads; t++) {
+        struct Render_Worker *worker = &pool->workers[t];
+        worker->pool = pool;
+        worker->first_ray = RAYS_NUMBER * t / num_threads;
+        worker->last_ray = RAYS_NUMBER * (t + 1) / num_threads;
+        worker->first_row = HEIGHT * t / num_threads;
+        worker->last_row = HEIGHT * (t + 1) / num_threads;
+        if (CreateLightBuffer(&worker->buffer) != 0 || CreateWavefront(&worker->wave) != 0) {
+            FreeLightBuffer(&worker->buffer);
+            FreeWavefront(&worker->wave);
+            pool->num_threads = t;
+            return -1;
+        }
+        worker->start = SDL_CreateSemaphore(0);
+        worker->thread = worker->start ? SDL_CreateThread(RenderWorker, "RenderWorker", worker) : NULL;
+        if (worker->thread == NULL) {
+            if (worker->start) SDL_DestroySemaphore(worker->start);
+            FreeLightBuffer(&worker->buffer);
+            FreeWavefront(&worker->wave);
+            pool->num_threads = t;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void RunRenderPhase(struct Render_Pool *pool, int phase) {
+    pool->phase = phase;
+    for (int t = 0; t < pool->num_threads; t++) {
+        SDL_SemPost(pool->workers[t].start);
+    }
+    for (int t = 0; t < pool->num_threads; t++) {
+        SDL_SemWait(pool->done);
+    }
+}
+
+long FillRays_Parallel(struct Render_Pool *pool, struct Light_Buffer *light, struct Ray rays[RAYS_NUMBER],
+                       struct Ray_Path paths[], struct Circle objects[], const struct BVH *bvh,
+                       const struct Light_Source *source, int max_bounces) {
+    pool->target = light;
+    pool->rays = rays;
+    pool->paths = paths;
+    pool->objects = objects;
+    pool->bvh = bvh;
+    pool->source = source;
+    pool->max_bounces = max_bounces;
+
+    RunRenderPhase(pool, PHASE_TRACE);
+    RunRenderPhase(pool, PHASE_REDUCE);
+
+    long pixels_written = 0;
+    for (int t = 0; t < pool->num_threads; t++) {
+        pixels_written += pool->workers[t].pixels_written;
+    }
+    return pixels_written;
+}
+
+void DestroyRenderPool(struct Render_Pool *pool) {
+    pool->phase = PHASE_QUIT;
+    for (int t = 0; t < pool->num_threads; t++) {
+        SDL_SemPost(pool->workers[t].start);
+    }
+    for (int t = 0; t < pool->num_threads; t++) {
+        SDL_WaitThread(pool->workers[t].thread, NULL);
+        SDL_DestroySemaphore(pool->workers[t].start);
+        FreeLightBuffer(&pool->workers[t].buffer);
+        FreeWavefront(&pool->workers[t].wave);
+    }
+    if (pool->done) SDL_DestroySemaphore(pool->done);
+}
+
+// Cached ray layer of one light, keyed by the light and the obstacles it was
+// traced against. The path of every ray is kept, so moving an obstacle only
+// re-traces the rays whose paths cross its old or new position and a static
+// scene costs nothing at all. Each light has its own layer, so moving one light
+// leaves the others as they are.
+struct Light_Map {
+    struct Light_Buffer buffer;
+    struct Wavefront wave;
+    struct Ray *rays;
+    struct Ray_Path *paths;
+    struct Ray_Segment *segments;
+    int max_bounces;
+    unsigned char *affected;
+    int valid;
+    struct Light_Source source;
+    SDL_Rect reach;             // everything the layer has lit lies inside
+    int traced_rays;            // rays marched by the last update
+    struct Circle *objects;
+    int num_objects;
+};
+
+int CreateLightMap(struct Light_Map *light, int max_bounces) {
+    light->rays = malloc(RAYS_NUMBER * sizeof(struct Ray));
+    light->paths = malloc(RAYS_NUMBER * sizeof(struct Ray_Path));
+    light->segments = malloc((size_t)RAYS_NUMBER * max_bounces * sizeof(struct Ray_Segment));
+    light->affected = malloc(RAYS_NUMBER);
+    light->max_bounces = max_bounces;
+    light->valid = 0;
+    light->reach = (SDL_Rect){0, 0, 0, 0};
+    light->traced_rays = 0;
+    light->objects = NULL;
+    light->num_objects = -1;
+    if (CreateLightBuffer(&light->buffer) != 0 || CreateWavefront(&light->wave) != 0 ||
+        light->rays == NULL || light->paths == NULL || light->segments == NULL ||
+        light->affected == NULL) return -1;
+    for (int i = 0; i < RAYS_NUMBER; i++) {
+        light->paths[i] = (struct Ray_Path){0, light->segments + (size_t)i * max_bounces};
+    }
+    return 0;
+}
+
+void DestroyLightMap(struct Light_Map *light) {
+    FreeLightBuffer(&light->buffer);
+    FreeWavefront(&light->wave);
+    free(light->rays);
+    free(light->paths);
+    free(light->segments);
+    free(light->objects);
+    free(light->affected);
+}
+
+// Bounding box of the pixels a path wrote, padded by a pixel for rounding
+void PathBounds(const struct Ray_Path *path, SDL_Rect *bounds) {
+    double min_x = WIDTH, min_y = HEIGHT, max_x = -1, max_y = -1;
+    for (int k = 0; k < path->num_segments; k++) {
+        struct Ray_Segment s = path->segments[k];
+        if (s.steps == 0) continue;
+        double end_x = s.x + s.dx * s.steps, end_y = s.y + s.dy * s.steps;
+        min_x = fmin(min_x, fmin(s.x, end_x));
+        min_y = fmin(min_y, fmin(s.y, end_y));
+        max_x = fmax(max_x, fmax(s.x, end_x));
+        max_y = fmax(max_y, fmax(s.y, end_y));
+    }
+    if (max_x < min_x) {
+        *bounds = (SDL_Rect){0, 0, 0, 0};
+        return;
+    }
+    bounds->x = (int)floor(min_x) - 1;
+    bounds->y = (int)floor(min_y) - 1;
+    bounds->w = (int)floor(max_x) - bounds->x + 2;
+    bounds->h = (int)floor(max_y) - bounds->y + 2;
+}
+
+// Could the path have been stopped by a circle at this position. The step
+// windows are conservative, so a path that misses every window of a circle
+// is traced identically whether or not the circle is there.
+int PathCrossesCircle(const struct Ray_Path *path, struct Circle circle) {
+    struct Hit_Window window;
+    for (int k = 0; k < path->num_segments; k++) {
+        struct Ray_Segment s = path->segments[k];
+        if (s.steps > 0 && RayCircleStepWindow(s.x, s.y, s.dx, s.dy, circle, 1, s.steps, &window)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Area a light can brighten before its falloff drops below the cutoff, clipped
+// to the screen. Reflections are attenuated from the light too, so they stay
+// inside it. Returns 0 when the light cannot reach any pixel.
+int LightReach(const struct Light_Source *source, SDL_Rect *reach) {
+    double range_sq = source->intensity * LIGHT_FALLOFF / LIGHT_CUTOFF - 1;
+    *reach = (SDL_Rect){0, 0, 0, 0};
+    if (range_sq <= 0) return 0;
+    int range = (int)ceil(sqrt(range_sq)) + 1;
+    SDL_Rect area = {(int)floor(source->circle.x) - range, (int)floor(source->circle.y) - range,
+                     2 * range + 2, 2 * range + 2};
+    SDL_Rect screen = {0, 0, WIDTH, HEIGHT};
+    return SDL_IntersectRect(&area, &screen, reach);
+}
+
+// Brings the light map up to date and returns the number of pixels written.
+// *dirty receives the area that changed and is empty when nothing did.
+long UpdateLightMap(struct Light_Map *light, struct Render_Pool *pool, const struct Light_Source *source,
+                    struct Circle objects[], const struct BVH *bvh, SDL_Rect *dirty) {
+    int num_objects = bvh->num_objects;
+    *dirty = (SDL_Rect){0, 0, 0, 0};
+    light->traced_rays = 0;
+    int moved = !light->valid || source->circle.x != light->source.circle.x ||
+                source->circle.y != light->source.circle.y || source->color != light->source.color ||
+                source->intensity != light->source.intensity;
+    int same_objects = light->valid && num_objects == light->num_objects &&
+                       memcmp(light->objects, objects, num_objects * sizeof(struct Circle)) == 0;
+    if (!moved && same_objects) return 0;
+    int full = moved || num_objects != light->num_objects;
+
+    struct Circle changed[2 * MAX_MOVED_OBSTACLES];
+    int num_changed = 0;
+    int num_affected = 0;
+    if (!full) {
+        for (int k = 0; k < num_objects; k++) {
+            struct Circle before = light->objects[k], after = objects[k];
+            if (before.x == after.x && before.y == after.y && before.r == after.r) continue;
+            // Many moving obstacles touch most rays anyway
+            if (num_changed + 2 > 2 * MAX_MOVED_OBSTACLES) {
+                full = 1;
+                break;
+            }
+            // The outline moves with the obstacle
+            struct Circle positions[2] = {before, after};
+            for (int c = 0; c < 2; c++) {
+                int r = (int)ceil(positions[c].r) + 2;
+                SDL_Rect outline = {(int)positions[c].x - r, (int)positions[c].y - r, 2 * r + 1, 2 * r + 1};
+                SDL_UnionRect(dirty, &outline, dirty);
+                // Obstacles the light cannot reach leave its rays alone
+                if (SDL_HasIntersection(&outline, &light->reach)) changed[num_changed++] = positions[c];
+            }
+        }
+    }
+    if (!full) {
+        for (int i = 0; i < RAYS_NUMBER; i++) {
+            light->affected[i] = 0;
+            for (int c = 0; c < num_changed && !light->affected[i]; c++) {
+                light->affected[i] = PathCrossesCircle(&light->paths[i], changed[c]);
+            }
+            num_affected += light->affected[i];
+        }
+        // Past this point clipping every ray to the dirty area costs more than tracing it
+        if (num_affected > RAYS_NUMBER / 2) full = 1;
+    }
+
+    light->valid = 1;
+    light->source = *source;
+    if (num_objects != light->num_objects) {
+        free(light->objects);
+        light->objects = malloc((num_objects + 1) * sizeof(struct Circle));
+        if (light->objects == NULL) {
+            light->valid = 0;
+            num_objects = 0;
+        }
+        light->num_objects = num_objects;
     }
+    memcpy(light->objects, objects, num_objects * sizeof(struct Circle));
+
+    SDL_Rect screen = {0, 0, WIDTH, HEIGHT};
+    if (full) {
+        // Everything the layer lit before and everything it can light now, or
+        // the whole screen when obstacle outlines may have moved as well
+        SDL_Rect before = light->reach;
+        LightReach(source, &light->reach);
+        if (same_objects) {
+            SDL_UnionRect(&before, &light->reach, dirty);
+        } else {
+            *dirty = screen;
+        }
+        ClearLight(&light->buffer, *dirty);
+        if (moved) generate_rays(source->circle, light->rays);
+        if (light->reach.w == 0) {
+            for (int i = 0; i < RAYS_NUMBER; i++) light->paths[i].num_segments = 0;
+            return 0;
+        }
+        light->traced_rays = RAYS_NUMBER;
+        if (pool) {
+            return FillRays_Parallel(pool, &light->buffer, light->rays, light->paths, objects, bvh,
+                                     source, light->max_bounces);
+        }
+        return FillRays(&light->buffer, &light->wave, light->rays, light->paths, objects, bvh,
+                        source, light->max_bounces);
+    }
+
+    // Only outlines moved, the light itself is unchanged
+    if (num_affected == 0) {
+        if (!SDL_IntersectRect(dirty, &screen, dirty)) *dirty = (SDL_Rect){0, 0, 0, 0};
+        return 0;
+    }
+
+    // Old and new extents of the affected rays bound everything that can change
+    struct Ray *rays = light->rays;
+    struct Wavefront *wave = &light->wave;
+    wave->num_current = 0;
+    for (int i = 0; i < RAYS_NUMBER; i++) {
+        if (!light->affected[i]) continue;
+        SDL_Rect bounds;
+        PathBounds(&light->paths[i], &bounds);
+        SDL_UnionRect(dirty, &bounds, dirty);
+        QueueRay(wave, rays, i, light->paths);
+    }
+    // Re-record the affected paths without drawing anything
+    SDL_Rect nowhere = {0, 0, 0, 0};
+    TraceWavefront(&light->buffer, wave, rays, objects, bvh, source, light->max_bounces,
+                   &nowhere, light->paths);
+    for (int i = 0; i < RAYS_NUMBER; i++) {
+        if (!light->affected[i]) continue;
+        SDL_Rect bounds;
+        PathBounds(&light->paths[i], &bounds);
+        SDL_UnionRect(dirty, &bounds, dirty);
+    }
+    if (!SDL_IntersectRect(dirty, &screen, dirty)) {
+        *dirty = (SDL_Rect){0, 0, 0, 0};
+        return 0;
+    }
+
+    // Clear the dirty area and redraw every ray that passes through it, clipped to it
+    ClearLight(&light->buffer, *dirty);
+    wave->num_current = 0;
+    for (int i = 0; i < RAYS_NUMBER; i++) {
+        SDL_Rect bounds;
+        PathBounds(&light->paths[i], &bounds);
+        if (SDL_HasIntersection(&bounds, dirty)) QueueRay(wave, rays, i, NULL);
+    }
+    light->traced_rays = wave->num_current;
+    return TraceWavefront(&light->buffer, wave, rays, objects, bvh, source, light->max_bounces,
+                          dirty, NULL);
 }
 
-int main() {
-    SDL_Init(SDL_INIT_VIDEO);
-    SDL_Window *window = SDL_CreateWindow("RAY_TRACING", SDL_WINDOWPOS_CENTERED, 
-                                          SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
-    SDL_Surface *surface = SDL_GetWindowSurface(window);
+// Sums the light layers inside area into target. Layers whose reach misses the
+// area are skipped, so far away and dim lights cost nothing there.
+void CombineLightMaps(struct Light_Buffer *target, const struct Light_Map maps[], int num_maps,
+                      SDL_Rect area) {
+    ClearLight(target, area);
+    for (int k = 0; k < num_maps; k++) {
+        SDL_Rect overlap;
+        if (!SDL_IntersectRect(&area, &maps[k].reach, &overlap)) continue;
+        for (int y = overlap.y; y < overlap.y + overlap.h; y++) {
+            int index = y * WIDTH + overlap.x;
+            AddLightRow(target->r + index, maps[k].buffer.r + index, overlap.w);
+            AddLightRow(target->g + index, maps[k].buffer.g + index, overlap.w);
+            AddLightRow(target->b + index, maps[k].buffer.b + index, overlap.w);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    // --threads N: number of render workers, 1 traces on the main thread
+    // --bounces N: reflections followed per ray
+    // --obstacles N: replace the default scene with N small drifting circles
+    // --lights N: number of light sources, up to MAX_LIGHTS
+    int num_threads = SDL_GetCPUCount();
+    int max_bounces = DEFAULT_BOUNCES;
+    int num_obstacles = 0;
+    int num_lights = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bounces") == 0 && i + 1 < argc) {
+            max_bounces = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--obstacles") == 0 && i + 1 < argc) {
+            num_obstacles = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lights") == 0 && i + 1 < argc) {
+            num_lights = atoi(argv[++i]);
+        }
+    }
+    if (num_lights < 1) num_lights = 1;
+    if (num_lights > MAX_LIGHTS) num_lights = MAX_LIGHTS;
+    if (num_obstacles < 0) num_obstacles = 0;
+    if (num_threads < 1) num_threads = 1;
+    if (max_bounces < 1) max_bounces = 1;
+
+    struct Bench bench;
+    int headless = bench_parse_args(&bench, argc, argv);
+    profile_parse_args(argc, argv);
+
+    SDL_Init(headless ? 0 : SDL_INIT_VIDEO);
+    struct Recorder recorder;
+    if (bench.record && recorder_open(&recorder, bench.record, WIDTH, HEIGHT, RECORD_FPS) != 0) {
+        printf("Could not record to %s\n", bench.record);
+        return 1;
+    }
+    SDL_Window *window = NULL;
+    SDL_Surface *surface;
+    if (headless) {
+        surface = bench_create_surface(WIDTH, HEIGHT);
+    } else {
+        window = SDL_CreateWindow("RAY_TRACING", SDL_WINDOWPOS_CENTERED, 
+                                  SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
+        surface = SDL_GetWindowSurface(window);
+    }
+
+    // Pick the shading kernel before any worker can ask for it
+    ray_shading_kernel();
+
+    static struct Render_Pool pool;
+    if (num_threads > 1 && CreateRenderPool(&pool, num_threads) != 0) {
+        printf("Could not start the render threads, tracing on one thread\n");
+        DestroyRenderPool(&pool);
+        num_threads = 1;
+    }
+
+    static struct Light_Map light_maps[MAX_LIGHTS];
+    static struct Light_Buffer combined;
+    for (int k = 0; k < num_lights; k++) {
+        if (CreateLightMap(&light_maps[k], max_bounces) != 0) {
+            printf("Could not allocate the light map\n");
+            return 1;
+        }
+    }
+    if (num_lights > 1 && CreateLightBuffer(&combined) != 0) {
+        printf("Could not allocate the light map\n");
+        return 1;
+    }
 
-    struct Circle circle = {200, 200, 20};
-    struct Circle shadow_circles[MAX_SHADOWS] = {
+    // The first light is the full-strength white one, the others are dimmer
+    // colored lights spread across the screen
+    static const Uint32 light_colors[MAX_LIGHTS] = {
+        COLOR_SOURCE, 0xffffa040, 0xff4080ff, 0xff40ff80,
+        0xffff40c0, 0xffff4040, 0xff40ffff, 0xffffff40
+    };
+    struct Light_Source lights[MAX_LIGHTS];
+    lights[0] = (struct Light_Source){{200, 200, 20}, light_colors[0], 1.0};
+    for (int k = 1; k < num_lights; k++) {
+        lights[k] = (struct Light_Source){
+            {WIDTH * (2 * k + 1) / (2.0 * num_lights), k % 2 ? HEIGHT * 0.75 : HEIGHT * 0.25, 20},
+            light_colors[k], SECONDARY_INTENSITY
+        };
+    }
+    int selected_light = 0;
+    struct Circle default_circles[DEFAULT_SHADOWS] = {
         {200, 200, 120},
         {1200, 500, 160},
         {400, 500, 160},
         {800, 300, 100},
         {1200, 200, 100}
     };
-    int num_shadows = 5;
+    int num_shadows = num_obstacles > 0 ? num_obstacles : DEFAULT_SHADOWS;
+    struct Circle *shadow_circles = malloc(num_shadows * sizeof(struct Circle));
+    double *obstacle_speed_x = calloc(num_shadows, sizeof(double));
+    double *obstacle_speed_y = calloc(num_shadows, sizeof(double));
+    if (shadow_circles == NULL || obstacle_speed_x == NULL || obstacle_speed_y == NULL) {
+        printf("Could not allocate the obstacles\n");
+        return 1;
+    }
+    if (num_obstacles > 0) {
+        // Fixed seed so benchmark runs see the same scene
+        srand(OBSTACLE_SEED);
+        for (int i = 0; i < num_shadows; i++) {
+            double r = 4 + rand() % 9;
+            shadow_circles[i] = (struct Circle){r + rand() % (int)(WIDTH - 2 * r),
+                                                r + rand() % (int)(HEIGHT - 2 * r), r};
+            obstacle_speed_x[i] = (rand() % 201 - 100) / 100.0;
+            obstacle_speed_y[i] = (rand() % 201 - 100) / 100.0;
+        }
+    } else {
+        memcpy(shadow_circles, default_circles, sizeof(default_circles));
+    }
 
-    struct Ray rays[RAYS_NUMBER];
-    double obstacle_speed_y[MAX_SHADOWS] = {1.0, -0.5, 0.8, -1.2};
+    static struct BVH bvh;
+    if (BuildBVH(&bvh, shadow_circles, num_shadows) != 0) {
+        printf("Could not allocate the obstacle hierarchy\n");
+        return 1;
+    }
+    int frames_since_build = 0;
 
     int simulation_running = 1;
     SDL_Event event;
-    int circle_moved = 1;
+    int dragged = -1;
+    int exposed = 0;
+    int overlay_shown = 0;
     
     srand(time(NULL));
-    generate_rays(circle, rays);
 
     while (simulation_running) {
-        circle_moved = 0;
         while (SDL_PollEvent(&event)) {
             if (event.type == SDL_QUIT) {
                 simulation_running = 0;
             }
-            if (event.type == SDL_MOUSEMOTION && event.motion.state != 0) {
-                circle.x = event.motion.x;
-                circle.y = event.motion.y;
-                circle_moved = 1;
+            if (event.type == SDL_WINDOWEVENT) {
+                exposed = 1;
+            }
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_p) {
+                profile_toggle_overlay();
+            }
+            // Right-drag moves an obstacle, any other drag moves the light
+            if (event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_RIGHT) {
+                for (int i = 0; i < num_shadows; i++) {
+                    if (RayIntersectsCircle(event.button.x, event.button.y, shadow_circles[i])) {
+                        dragged = i;
+                        break;
+                    }
+                }
+            }
+            if (event.type == SDL_MOUSEBUTTONUP && event.button.button == SDL_BUTTON_RIGHT) {
+                dragged = -1;
+            }
+            // Any other button picks the nearest light
+            if (event.type == SDL_MOUSEBUTTONDOWN && event.button.button != SDL_BUTTON_RIGHT) {
+                double nearest = INFINITY;
+                for (int k = 0; k < num_lights; k++) {
+                    double dx = event.button.x - lights[k].circle.x;
+                    double dy = event.button.y - lights[k].circle.y;
+                    if (dx * dx + dy * dy < nearest) {
+                        nearest = dx * dx + dy * dy;
+                        selected_light = k;
+                    }
+                }
+            }
+            if (event.type == SDL_MOUSEMOTION && (event.motion.state & SDL_BUTTON_RMASK)) {
+                if (dragged >= 0) {
+                    shadow_circles[dragged].x += event.motion.xrel;
+                    shadow_circles[dragged].y += event.motion.yrel;
+                }
+            } else if (event.type == SDL_MOUSEMOTION && event.motion.state != 0) {
+                lights[selected_light].circle.x = event.motion.x;
+                lights[selected_light].circle.y = event.motion.y;
             }
         }
 
-        if (circle_moved) {
-            generate_rays(circle, rays);
+        if (headless) {
+            bench_frame_begin(&bench);
+            bench_light_position(&bench, WIDTH, HEIGHT, &lights[0].circle.x, &lights[0].circle.y);
+        }
+
+        // Generated obstacles drift and bounce off the walls
+        if (num_obstacles > 0) {
+            for (int i = 0; i < num_shadows; i++) {
+                struct Circle *c = &shadow_circles[i];
+                c->x += obstacle_speed_x[i];
+                c->y += obstacle_speed_y[i];
+                if (c->x - c->r < 0 || c->x + c->r > WIDTH) obstacle_speed_x[i] = -obstacle_speed_x[i];
+                if (c->y - c->r < 0 || c->y + c->r > HEIGHT) obstacle_speed_y[i] = -obstacle_speed_y[i];
+            }
         }
 
-        SDL_FillRect(surface, NULL, COLOR_BLACK);
+        // Refitting keeps the tree valid as obstacles move, but the boxes grow
+        // looser as they drift apart, so it is rebuilt from time to time
+        Uint64 bvh_start = profile_now();
+        if (++frames_since_build >= BVH_REBUILD_FRAMES) {
+            BuildBVH(&bvh, shadow_circles, num_shadows);
+            frames_since_build = 0;
+        } else {
+            RefitBVH(&bvh, shadow_circles);
+        }
+        profile_record("bvh", bvh_start);
 
-        for (int i = 0; i < num_shadows; i++) {
-            FillCircle_Outline(surface, shadow_circles[i], COLOR_WHITE);
+        // Every light shares the obstacle tree and the workers, and only the
+        // layers of lights that changed are traced again
+        SDL_Rect dirty = {0, 0, 0, 0};
+        long pixels_written = 0;
+        long traced_rays = 0;
+        for (int k = 0; k < num_lights; k++) {
+            SDL_Rect changed;
+            pixels_written += UpdateLightMap(&light_maps[k], num_threads > 1 ? &pool : NULL, &lights[k],
+                                             shadow_circles, &bvh, &changed);
+            traced_rays += light_maps[k].traced_rays;
+            SDL_UnionRect(&dirty, &changed, &dirty);
+        }
+        // The overlay is redrawn every frame it is shown, and once more when
+        // it is hidden to uncover the light beneath it
+        if (profiler.overlay || overlay_shown) {
+            SDL_Rect overlay;
+            profile_overlay_rect(&overlay);
+            SDL_UnionRect(&dirty, &overlay, &dirty);
+            overlay_shown = profiler.overlay;
+        }
+        if (dirty.w > 0) {
+            PROFILE_SCOPE("rasterize");
+            if (num_lights == 1) {
+                ResolveLight(&light_maps[0].buffer, surface, dirty);
+            } else {
+                CombineLightMaps(&combined, light_maps, num_lights, dirty);
+                ResolveLight(&combined, surface, dirty);
+            }
+            for (int i = 0; i < num_shadows; i++) {
+                FillCircle_Outline(surface, shadow_circles[i], COLOR_WHITE);
+            }
+            profile_draw_surface(surface);
         }
 
-        FillRays(surface, rays, shadow_circles, num_shadows, COLOR_SOURCE);
+        if (headless) {
+            if (bench.record) recorder_push(&recorder, surface);
+            bench_frame_end(&bench, traced_rays, pixels_written);
+            simulation_running = bench_running(&bench);
+        } else if (dirty.w > 0 || exposed) {
+            Uint64 present_start = profile_now();
+            SDL_UpdateWindowSurface(window);
+            profile_record("present", present_start);
+            exposed = 0;
+            SDL_Delay(1);
+        } else {
+            // Nothing changed, so sleep until the next input event
+            SDL_WaitEventTimeout(NULL, 100);
+        }
+        profile_frame();
+    }
+    profile_shutdown();
 
-        SDL_UpdateWindowSurface(window);
-        SDL_Delay(1);
+    if (headless) {
+        if (bench.record) recorder_close(&recorder, bench.record);
+        bench_report(&bench, "Full-Ray-Tracing-And-Shadow-Casting");
+        bench_free(&bench);
+        SDL_FreeSurface(surface);
     }
 
+    if (num_threads > 1) {
+        DestroyRenderPool(&pool);
+    }
+    for (int k = 0; k < num_lights; k++) {
+        DestroyLightMap(&light_maps[k]);
+    }
+    FreeLightBuffer(&combined);
+    FreeBVH(&bvh);
+    free(shadow_circles);
+    free(obstacle_speed_x);
+    free(obstacle_speed_y);
     SDL_DestroyWindow(window);
     SDL_Quit();
     return 0;
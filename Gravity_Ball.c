@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include <SDL2/SDL.h>
+#include "Profiler.h"
 
 #define WIDTH 1000
 #define HEIGHT 800
@@ -9,6 +12,13 @@
 #define COLOR_GRAY 0xefefefef
 #define Gravity 9.8
 #define COEFF_OF_RESTITUTION 0.8
+#define SPAN_CACHE_SIZE 8
+#define PHYSICS_HZ 240          // Physics steps per second, independent of the render rate
+#define PIXELS_PER_METER 1000.0 // Keeps the old 0.0098 px/frame^2 feel of a 1000 FPS loop
+#define MAX_FRAME_TIME 0.25     // Longest wall-clock gap simulated at once, so a stall cannot snowball
+#define FRAME_BUDGET (1.0 / 60) // Physics taking longer than this skips the render instead of steps
+#define MAX_SKIPPED_FRAMES 5
+#define REST_SPEED 1e-3         // Event mode: a rebound slower than this (px per step) comes to rest
 
 struct Circle{
     double x;
@@ -16,50 +26,187 @@ struct Circle{
     double r;
 };
 
+// Filled circles are drawn as one horizontal span per row. The spans depend only
+// on the radius, so they are computed once and cached, and a whole circle is
+// submitted with a single SDL_RenderFillRects call instead of one call per pixel.
+struct Circle_Spans{
+    double r;
+    int rows;
+    int *half_width;  // Row y covers x in [-half_width, half_width] (row 0 is y = -r)
+    SDL_Rect *rects;  // Scratch buffer for translating the spans to screen space
+};
+
+struct Circle_Spans *circle_spans(double r){
+    static struct Circle_Spans cache[SPAN_CACHE_SIZE];
+    static int cached = 0, next_slot = 0;
+
+    for (int i = 0; i < cached; i++){
+        if (cache[i].r == r) return &cache[i];
+    }
+
+    struct Circle_Spans *spans;
+    if (cached < SPAN_CACHE_SIZE){
+        spans = &cache[cached++];
+    } else {
+        spans = &cache[next_slot];
+        next_slot = (next_slot + 1) % SPAN_CACHE_SIZE;
+        free(spans->half_width);
+        free(spans->rects);
+    }
+
+    int radius = (int)r;
+    spans->r = r;
+    spans->rows = 2 * radius + 1;
+    spans->half_width = malloc(sizeof(int) * spans->rows);
+    spans->rects = malloc(sizeof(SDL_Rect) * spans->rows);
+    for (int y = -radius; y <= radius; y++){
+        // Same inclusion test as the per-pixel loop: x * x + y * y <= r * r
+        int w = (int)sqrt(r * r - y * y);
+        while (w < radius && (w + 1) * (w + 1) + y * y <= r * r) w++;
+        while (w > 0 && w * w + y * y > r * r) w--;
+        spans->half_width[y + radius] = w;
+    }
+    return spans;
+}
+
 void draw_circle(SDL_Renderer *renderer, struct Circle circle, Uint8 r, Uint8 g, Uint8 b, Uint8 a){
+    struct Circle_Spans *spans = circle_spans(circle.r);
+    int radius = (int)circle.r;
+    for (int row = 0; row < spans->rows; row++){
+        int w = spans->half_width[row];
+        spans->rects[row] = (SDL_Rect){(int)(circle.x - w), (int)(circle.y + row - radius), 2 * w + 1, 1};
+    }
     SDL_SetRenderDrawColor(renderer, r, g, b, a);
-    for(int y = -circle.r; y <= circle.r; y++){
-        for (int x = -circle.r; x <= circle.r; x++){
-            if(x*x + y*y <= circle.r*circle.r){
-                SDL_RenderDrawPoint(renderer, circle.x + x, circle.y + y);
-            }
-        }
+    SDL_RenderFillRects(renderer, spans->rects, spans->rows);
+}
+
+// Event mode flies the ball on its exact parabola y(t) = y + v t + a t^2 / 2 and
+// jumps from one floor impact to the next, so a fast ball never sinks into the
+// floor and every bounce loses exactly the energy the restitution says.
+struct Flight{
+    double start;     // Physics step the parabola starts at
+    double y, v;      // Position and velocity at start
+    double a;         // Acceleration, 0 once the ball rests on the floor
+    double impact;    // Step of the next floor impact, INFINITY when there is none
+};
+
+// Positive root of a t^2 / 2 + v t - d = 0, the time to fall d pixels, written so it cannot cancel
+double fall_time(double v, double a, double d){
+    if (d < 0) d = 0;
+    double disc = sqrt(v * v + 2 * a * d);
+    return v > 0 ? 2 * d / (v + disc) : (-v + disc) / a;
+}
+
+void flight_start(struct Flight *flight, double start, double y, double v, double a, double floor_y){
+    *flight = (struct Flight){start, y, v, a, INFINITY};
+    if (a > 0) flight->impact = start + fall_time(v, a, floor_y - y);
+}
+
+// Processes every impact up to step until and returns the height there
+double flight_advance(struct Flight *flight, double until, double floor_y, double e){
+    while (flight->impact <= until){
+        double rebound = -(flight->v + flight->a * (flight->impact - flight->start)) * e;
+        double a = -rebound < REST_SPEED ? 0 : flight->a;
+        flight_start(flight, flight->impact, floor_y, a > 0 ? rebound : 0, a, floor_y);
     }
+    double t = until - flight->start;
+    return flight->y + flight->v * t + 0.5 * flight->a * t * t;
 }
 
-int main(){
+int main(int argc, char *argv[]){
+    // --profile shows the frame profiler overlay, --trace PATH writes a Chrome trace at exit
+    // --events jumps between exact floor impacts instead of stepping and testing for overlap
+    profile_parse_args(argc, argv);
+    int use_events = 0;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--events") == 0) use_events = 1;
+    }
     SDL_Init(SDL_INIT_VIDEO);
     SDL_Window *window = SDL_CreateWindow("Gravity_Ball", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
 
     struct Circle circle = {400, 400, 80};
+    // Physics runs in fixed steps of dt; velocity is in px per step
+    double dt = 1.0 / PHYSICS_HZ;
     double velocity = 0;
-    double acceleration = Gravity*0.001;
+    double acceleration = Gravity * PIXELS_PER_METER * dt * dt;
     double e = COEFF_OF_RESTITUTION;
+    double previous_y = circle.y;
+    double step = 0;
+    struct Flight flight;
+    flight_start(&flight, 0, circle.y, velocity, acceleration, HEIGHT - circle.r);
+
+    double accumulator = 0;
+    double frequency = (double)SDL_GetPerformanceFrequency();
+    Uint64 last_time = SDL_GetPerformanceCounter();
+    int skipped_frames = 0;
 
     int simulation_running = 1;
     SDL_Event event;
 
     while (simulation_running){
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); // Background Color
-        SDL_RenderClear(renderer);
         while(SDL_PollEvent(&event)){
             if (event.type == SDL_QUIT){
                 simulation_running = 0;
             }
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_p){
+                profile_toggle_overlay();
+            }
+        }
+
+        Uint64 now = SDL_GetPerformanceCounter();
+        double frame_time = (now - last_time) / frequency;
+        last_time = now;
+        if (frame_time > MAX_FRAME_TIME) frame_time = MAX_FRAME_TIME;
+        accumulator += frame_time;
+
+        Uint64 integrate_start = profile_now();
+        while (accumulator >= dt){
+            previous_y = circle.y;
+            if (use_events){
+                circle.y = flight_advance(&flight, step + 1, HEIGHT - circle.r, e);
+            } else {
+                velocity += acceleration;
+                circle.y += velocity;
+
+                if(circle.y + circle.r > HEIGHT){
+                    circle.y = HEIGHT - circle.r;
+                    velocity = -velocity * e;
+                }
+            }
+            step++;
+            accumulator -= dt;
         }
-        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-        velocity += acceleration;
-        circle.y += velocity;
+        profile_record("integrate", integrate_start);
 
-        if(circle.y + circle.r > HEIGHT){
-            circle.y = HEIGHT - circle.r;
-            velocity = -velocity * e;
+        // Physics has priority: if it used up the frame budget, skip drawing this time
+        double physics_time = (SDL_GetPerformanceCounter() - now) / frequency;
+        if (physics_time > FRAME_BUDGET && skipped_frames < MAX_SKIPPED_FRAMES){
+            skipped_frames++;
+            profile_frame();
+            continue;
         }
-        draw_circle(renderer, circle, 255, 255, 255, 255);
+        skipped_frames = 0;
+
+        // Draw between the last two physics states
+        double alpha = accumulator / dt;
+        struct Circle drawn = circle;
+        drawn.y = previous_y + (circle.y - previous_y) * alpha;
+
+        Uint64 rasterize_start = profile_now();
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); // Background Color
+        SDL_RenderClear(renderer);
+        draw_circle(renderer, drawn, 255, 255, 255, 255);
+        profile_draw_renderer(renderer);
+        profile_record("rasterize", rasterize_start);
+
+        Uint64 present_start = profile_now();
         SDL_RenderPresent(renderer);
-        SDL_Delay(1); // Approximately 1000 FPS
+        profile_record("present", present_start);
+        profile_frame();
+        SDL_Delay(1);
     }
+    profile_shutdown();
 
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
@@ -0,0 +1,336 @@
+// Frame profiler shared by the simulations and ray tracers.
+//
+//   ./Ray_Tracing --profile               show the stats overlay (P toggles it)
+//   ./Ray_Tracing --trace frames.json     also write a Chrome trace at exit
+//
+// Hot paths are wrapped in named zones, either PROFILE_SCOPE("trace") for the
+// rest of a block or a profile_now() / profile_record() pair. Every thread
+// records into its own ring buffer with nanosecond timestamps; the ring has a
+// single writer and a single reader, so recording takes no lock and never
+// waits. Once per frame the main thread calls profile_frame(), which drains
+// the rings into per-zone averages for the overlay and, with --trace, into the
+// event list written at exit. Load the trace in chrome://tracing or Perfetto.
+//
+// While neither the overlay nor a trace was ever asked for, recording a zone
+// is a single branch.
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#define PROFILE_MAX_THREADS 64
+#define PROFILE_RING_EVENTS 1024
+#define PROFILE_MAX_ZONES 16
+#define PROFILE_TRACE_MAX_EVENTS (1 << 20)
+#define PROFILE_SMOOTHING 0.05     // weight of the newest frame in the averages
+#define PROFILE_BUDGET_MS (1000.0 / 60)
+
+#ifdef __cplusplus
+#define PROFILE_THREAD_LOCAL thread_local
+#else
+#define PROFILE_THREAD_LOCAL _Thread_local
+#endif
+
+struct Profile_Event {
+    const char *name;
+    Uint64 start, end;          // nanoseconds since the profiler started
+};
+
+// Written only by its owner thread and read only by the main thread
+struct Profile_Ring {
+    SDL_atomic_t head, tail;
+    int dropped;
+    struct Profile_Event events[PROFILE_RING_EVENTS];
+};
+
+struct Profile_Zone {
+    const char *name;
+    Uint64 frame_ns;            // time inside the zone this frame, over all threads
+    double average_ms;
+};
+
+struct Profile_Trace_Event {
+    struct Profile_Event event;
+    int thread;
+};
+
+struct Profiler {
+    int enabled;
+    int overlay;
+    const char *trace_path;
+    Uint64 origin, frequency;
+    Uint64 last_frame;
+    double frame_ms;
+    SDL_atomic_t num_rings;
+    struct Profile_Ring rings[PROFILE_MAX_THREADS];
+    struct Profile_Zone zones[PROFILE_MAX_ZONES];
+    int num_zones;
+    struct Profile_Trace_Event *trace;
+    int trace_count;
+};
+
+static struct Profiler profiler;
+static PROFILE_THREAD_LOCAL int profile_thread = -1;
+
+static inline Uint64 profile_now(void) {
+    if (profiler.frequency == 0) return 0;
+    Uint64 ticks = SDL_GetPerformanceCounter() - profiler.origin;
+    return ticks / profiler.frequency * 1000000000u +
+           ticks % profiler.frequency * 1000000000u / profiler.frequency;
+}
+
+static inline void profile_enable(void) {
+    if (profiler.frequency == 0) {
+        profiler.frequency = SDL_GetPerformanceFrequency();
+        profiler.origin = SDL_GetPerformanceCounter();
+    }
+    profiler.enabled = 1;
+}
+
+// --profile shows the overlay from the start, --trace PATH writes a Chrome trace at exit
+static inline void profile_parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--profile") == 0) {
+            profiler.overlay = 1;
+            profile_enable();
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            profiler.trace_path = argv[++i];
+            profile_enable();
+        }
+    }
+    if (profiler.trace_path) {
+        profiler.trace = (struct Profile_Trace_Event *)malloc(PROFILE_TRACE_MAX_EVENTS * sizeof(struct Profile_Trace_Event));
+        if (profiler.trace == NULL) profiler.trace_path = NULL;
+    }
+}
+
+// Records a zone that started at start and ends now
+static inline void profile_record(const char *name, Uint64 start) {
+    if (!profiler.enabled || start == 0) return;     // started before profiling was on
+    if (profile_thread < 0) {
+        profile_thread = SDL_AtomicAdd(&profiler.num_rings, 1);
+        if (profile_thread >= PROFILE_MAX_THREADS) profile_thread = PROFILE_MAX_THREADS;
+    }
+    if (profile_thread >= PROFILE_MAX_THREADS) return;
+
+    struct Profile_Ring *ring = &profiler.rings[profile_thread];
+    int head = SDL_AtomicGet(&ring->head);
+    if (head - SDL_AtomicGet(&ring->tail) == PROFILE_RING_EVENTS) {
+        ring->dropped++;
+        return;
+    }
+    struct Profile_Event *event = &ring->events[head % PROFILE_RING_EVENTS];
+    event->name = name;
+    event->start = start;
+    event->end = profile_now();
+    SDL_AtomicSet(&ring->head, head + 1);
+}
+
+struct Profile_Scope {
+    const char *name;
+    Uint64 start;
+};
+
+static inline void profile_scope_end(struct Profile_Scope *scope) {
+    profile_record(scope->name, scope->start);
+}
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#ifdef __cplusplus
+struct Profile_Scope_Guard {
+    Profile_Scope scope;
+    explicit Profile_Scope_Guard(const char *name) : scope{name, profile_now()} {}
+    ~Profile_Scope_Guard() { profile_scope_end(&scope); }
+};
+#define PROFILE_SCOPE(name) Profile_Scope_Guard PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#else
+#define PROFILE_SCOPE(name) \
+    struct Profile_Scope PROFILE_CONCAT(profile_scope_, __LINE__) \
+        __attribute__((cleanup(profile_scope_end))) = {name, profile_now()}
+#endif
+
+static inline struct Profile_Zone *profile_zone(const char *name) {
+    for (int i = 0; i < profiler.num_zones; i++) {
+        if (profiler.zones[i].name == name || strcmp(profiler.zones[i].name, name) == 0) {
+            return &profiler.zones[i];
+        }
+    }
+    if (profiler.num_zones == PROFILE_MAX_ZONES) return NULL;
+    struct Profile_Zone *zone = &profiler.zones[profiler.num_zones++];
+    zone->name = name;
+    zone->frame_ns = 0;
+    zone->average_ms = 0;
+    return zone;
+}
+
+// Ends the frame on the main thread: drains every ring and updates the averages
+static inline void profile_frame(void) {
+    if (!profiler.enabled) return;
+    for (int i = 0; i < profiler.num_zones; i++) profiler.zones[i].frame_ns = 0;
+
+    int num_rings = SDL_AtomicGet(&profiler.num_rings);
+    if (num_rings > PROFILE_MAX_THREADS) num_rings = PROFILE_MAX_THREADS;
+    for (int t = 0; t < num_rings; t++) {
+        struct Profile_Ring *ring = &profiler.rings[t];
+        int head = SDL_AtomicGet(&ring->head);
+        for (int i = SDL_AtomicGet(&ring->tail); i != head; i++) {
+            struct Profile_Event event = ring->events[i % PROFILE_RING_EVENTS];
+            struct Profile_Zone *zone = profile_zone(event.name);
+            if (zone) zone->frame_ns += event.end - event.start;
+            if (profiler.trace && profiler.trace_count < PROFILE_TRACE_MAX_EVENTS) {
+                profiler.trace[profiler.trace_count].event = event;
+                profiler.trace[profiler.trace_count].thread = t;
+                profiler.trace_count++;
+            }
+        }
+        SDL_AtomicSet(&ring->tail, head);
+    }
+
+    Uint64 now = profile_now();
+    double frame_ms = (now - profiler.last_frame) / 1e6;
+    int first = profiler.last_frame == 0;
+    profiler.last_frame = now;
+    if (first) return;
+    profiler.frame_ms += PROFILE_SMOOTHING * (frame_ms - profiler.frame_ms);
+    for (int i = 0; i < profiler.num_zones; i++) {
+        struct Profile_Zone *zone = &profiler.zones[i];
+        zone->average_ms += PROFILE_SMOOTHING * (zone->frame_ns / 1e6 - zone->average_ms);
+    }
+}
+
+static inline void profile_toggle_overlay(void) {
+    profiler.overlay = !profiler.overlay;
+    if (profiler.overlay) profile_enable();
+}
+
+// 3x5 pixel glyphs, one string of 15 bits per character, top row first
+static inline const char *profile_glyph(char c) {
+    static const char *const glyphs[][2] = {
+        {"0", "111101101101111"}, {"1", "010110010010111"}, {"2", "111001111100111"},
+        {"3", "111001111001111"}, {"4", "101101111001001"}, {"5", "111100111001111"},
+        {"6", "111100111101111"}, {"7", "111001001001001"}, {"8", "111101111101111"},
+        {"9", "111101111001111"}, {"A", "010101111101101"}, {"B", "110101110101110"},
+        {"C", "011100100100011"}, {"D", "110101101101110"}, {"E", "111100110100111"},
+        {"F", "111100110100100"}, {"G", "011100101101011"}, {"H", "101101111101101"},
+        {"I", "111010010010111"}, {"J", "001001001101010"}, {"K", "101101110101101"},
+        {"L", "100100100100111"}, {"M", "101111111101101"}, {"N", "110101101101101"},
+        {"O", "010101101101010"}, {"P", "110101110100100"}, {"Q", "010101101110011"},
+        {"R", "110101110101101"}, {"S", "011100010001110"}, {"T", "111010010010010"},
+        {"U", "101101101101111"}, {"V", "101101101101010"}, {"W", "101101111111101"},
+        {"X", "101101010101101"}, {"Y", "101101010010010"}, {"Z", "111001010100111"},
+        {".", "000000000000010"}, {":", "000010000010000"}, {"-", "000000111000000"},
+        {"/", "001001010100100"}, {"%", "101001010100101"}, {"_", "000000000000111"},
+    };
+    if (c >= 'a' && c <= 'z') c = (char)(c - 'a' + 'A');
+    for (size_t i = 0; i < sizeof(glyphs) / sizeof(glyphs[0]); i++) {
+        if (glyphs[i][0][0] == c) return glyphs[i][1];
+    }
+    return NULL;
+}
+
+#define PROFILE_SCALE 2
+#define PROFILE_LINE (7 * PROFILE_SCALE)
+#define PROFILE_PANEL_WIDTH 360
+#define PROFILE_BAR_X 200
+#define PROFILE_BAR_WIDTH 120      // one frame budget
+
+typedef void (*Profile_Fill)(void *target, const SDL_Rect *rect, Uint8 r, Uint8 g, Uint8 b);
+
+static inline void profile_text(Profile_Fill fill, void *target, int x, int y, const char *text) {
+    for (; *text; text++, x += 4 * PROFILE_SCALE) {
+        const char *glyph = profile_glyph(*text);
+        if (glyph == NULL) continue;
+        for (int bit = 0; bit < 15; bit++) {
+            if (glyph[bit] != '1') continue;
+            SDL_Rect dot = {x + bit % 3 * PROFILE_SCALE, y + bit / 3 * PROFILE_SCALE, PROFILE_SCALE, PROFILE_SCALE};
+            fill(target, &dot, 255, 255, 255);
+        }
+    }
+}
+
+// Screen area the overlay covers, so callers that only redraw what changed can
+// include it
+static inline void profile_overlay_rect(SDL_Rect *rect) {
+    rect->x = 0;
+    rect->y = 0;
+    rect->w = PROFILE_PANEL_WIDTH;
+    rect->h = (profiler.num_zones + 1) * PROFILE_LINE + 2 * PROFILE_SCALE;
+}
+
+static inline void profile_draw(Profile_Fill fill, void *target) {
+    if (!profiler.overlay) return;
+    SDL_Rect panel;
+    profile_overlay_rect(&panel);
+    fill(target, &panel, 16, 16, 24);
+
+    char line[64];
+    int y = 2 * PROFILE_SCALE;
+    snprintf(line, sizeof(line), "FRAME %6.2f MS", profiler.frame_ms);
+    profile_text(fill, target, 2 * PROFILE_SCALE, y, line);
+    for (int i = 0; i < profiler.num_zones; i++) {
+        const struct Profile_Zone *zone = &profiler.zones[i];
+        y += PROFILE_LINE;
+        snprintf(line, sizeof(line), "%-10.10s %6.2f", zone->name, zone->average_ms);
+        profile_text(fill, target, 2 * PROFILE_SCALE, y, line);
+
+        // Bars are scaled to a 60 Hz frame and turn red past it
+        int width = (int)(zone->average_ms / PROFILE_BUDGET_MS * PROFILE_BAR_WIDTH);
+        if (width > PROFILE_PANEL_WIDTH - PROFILE_BAR_X - PROFILE_SCALE) {
+            width = PROFILE_PANEL_WIDTH - PROFILE_BAR_X - PROFILE_SCALE;
+        }
+        SDL_Rect bar = {PROFILE_BAR_X, y, width, 5 * PROFILE_SCALE};
+        if (zone->average_ms > PROFILE_BUDGET_MS) fill(target, &bar, 220, 60, 60);
+        else fill(target, &bar, 80, 200, 120);
+    }
+}
+
+static inline void profile_fill_surface(void *target, const SDL_Rect *rect, Uint8 r, Uint8 g, Uint8 b) {
+    SDL_Surface *surface = (SDL_Surface *)target;
+    SDL_FillRect(surface, rect, SDL_MapRGB(surface->format, r, g, b));
+}
+
+static inline void profile_fill_renderer(void *target, const SDL_Rect *rect, Uint8 r, Uint8 g, Uint8 b) {
+    SDL_Renderer *renderer = (SDL_Renderer *)target;
+    SDL_SetRenderDrawColor(renderer, r, g, b, 255);
+    SDL_RenderFillRect(renderer, rect);
+}
+
+static inline void profile_draw_surface(SDL_Surface *surface) {
+    profile_draw(profile_fill_surface, surface);
+}
+
+static inline void profile_draw_renderer(SDL_Renderer *renderer) {
+    profile_draw(profile_fill_renderer, renderer);
+}
+
+// Writes the Chrome trace when one was asked for
+static inline void profile_shutdown(void) {
+    profile_frame();
+    if (profiler.trace_path) {
+        FILE *out = fopen(profiler.trace_path, "w");
+        if (out == NULL) {
+            printf("Could not write the trace to %s\n", profiler.trace_path);
+        } else {
+            fprintf(out, "{\"traceEvents\":[\n");
+            for (int i = 0; i < profiler.trace_count; i++) {
+                const struct Profile_Trace_Event *e = &profiler.trace[i];
+                fprintf(out, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+                        e->event.name, e->thread, e->event.start / 1e3, (e->event.end - e->event.start) / 1e3,
+                        i + 1 < profiler.trace_count ? "," : "");
+            }
+            fprintf(out, "]}\n");
+            fclose(out);
+            printf("Wrote %d trace events to %s\n", profiler.trace_count, profiler.trace_path);
+        }
+    }
+    free(profiler.trace);
+    profiler.trace = NULL;
+}
+
+#endif
@@ -0,0 +1,124 @@
+// Counter-based random numbers shared by the particle simulations.
+//
+// There is no generator state. A number is a hash of (seed, id, counter): the id
+// is usually a particle index and the counter packs the physics step with what
+// the number is for. The same inputs always give the same number, on any thread
+// and in any order, so the results of a simulation do not depend on how its work
+// is split or scheduled. Unlike rand() there is no shared state to lock.
+//
+// The hash is two rounds of the SplitMix64 finalizer: the first turns (seed, id)
+// into a key for that id, the second mixes the key with the counter. Doubles
+// take the top 52 bits as the mantissa of a number in [1, 2) and subtract 1,
+// which the AVX2 batch kernel does the same way, so both give identical values.
+
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define RANDOM_X86 1
+#endif
+
+#define RANDOM_GOLDEN 0x9E3779B97F4A7C15ull
+#define RANDOM_MIX1 0xBF58476D1CE4E5B9ull
+#define RANDOM_MIX2 0x94D049BB133111EBull
+#define RANDOM_ONE_BITS 0x3FF0000000000000ull     // 1.0 as a double
+
+static inline Uint64 random_mix(Uint64 z) {
+    z = (z ^ (z >> 30)) * RANDOM_MIX1;
+    z = (z ^ (z >> 27)) * RANDOM_MIX2;
+    return z ^ (z >> 31);
+}
+
+// Key of one id. Hoist it out of loops that draw several numbers for the same id.
+static inline Uint64 random_key(Uint64 seed, Uint64 id) {
+    return random_mix(seed + id * RANDOM_GOLDEN);
+}
+
+static inline Uint64 random_bits_keyed(Uint64 key, Uint64 counter) {
+    return random_mix(key + counter * RANDOM_GOLDEN);
+}
+
+static inline double random_bits_to_unit(Uint64 bits) {
+    Uint64 mantissa = (bits >> 12) | RANDOM_ONE_BITS;
+    double d;
+    memcpy(&d, &mantissa, sizeof(d));
+    return d - 1.0;
+}
+
+// Uniform in [0, 1)
+static inline double random_uniform_keyed(Uint64 key, Uint64 counter) {
+    return random_bits_to_unit(random_bits_keyed(key, counter));
+}
+
+static inline double random_uniform(Uint64 seed, Uint64 id, Uint64 counter) {
+    return random_uniform_keyed(random_key(seed, id), counter);
+}
+
+// Uniform in [-1, 1)
+static inline double random_signed_keyed(Uint64 key, Uint64 counter) {
+    return 2.0 * random_uniform_keyed(key, counter) - 1.0;
+}
+
+// Fills out[k] with random_uniform(seed, ids[k], counter) for k < n
+typedef void (*Random_Batch)(Uint64 seed, const int *ids, int n, Uint64 counter, double *out);
+
+static inline void random_uniform_batch_scalar(Uint64 seed, const int *ids, int n, Uint64 counter, double *out) {
+    for (int k = 0; k < n; k++) {
+        out[k] = random_uniform(seed, (Uint64)(Sint64)ids[k], counter);
+    }
+}
+
+#ifdef RANDOM_X86
+// Low 64 bits of a * b in every lane, from 32-bit multiplies
+__attribute__((target("avx2")))
+static inline __m256i random_mul_avx2(__m256i a, Uint64 b) {
+    const __m256i b_lo = _mm256_set1_epi64x((long long)(b & 0xFFFFFFFFu));
+    const __m256i b_hi = _mm256_set1_epi64x((long long)(b >> 32));
+    __m256i lo = _mm256_mul_epu32(a, b_lo);
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b_lo),
+                                     _mm256_mul_epu32(a, b_hi));
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i random_mix_avx2(__m256i z) {
+    z = random_mul_avx2(_mm256_xor_si256(z, _mm256_srli_epi64(z, 30)), RANDOM_MIX1);
+    z = random_mul_avx2(_mm256_xor_si256(z, _mm256_srli_epi64(z, 27)), RANDOM_MIX2);
+    return _mm256_xor_si256(z, _mm256_srli_epi64(z, 31));
+}
+
+__attribute__((target("avx2")))
+static inline void random_uniform_batch_avx2(Uint64 seed, const int *ids, int n, Uint64 counter, double *out) {
+    const __m256i seed4 = _mm256_set1_epi64x((long long)seed);
+    const __m256i step4 = _mm256_set1_epi64x((long long)(counter * RANDOM_GOLDEN));
+    const __m256i one = _mm256_set1_epi64x((long long)RANDOM_ONE_BITS);
+    int k = 0;
+    for (; k + 4 <= n; k += 4) {
+        __m256i id = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *)(ids + k)));
+        __m256i key = random_mix_avx2(_mm256_add_epi64(seed4, random_mul_avx2(id, RANDOM_GOLDEN)));
+        __m256i bits = random_mix_avx2(_mm256_add_epi64(key, step4));
+        __m256i mantissa = _mm256_or_si256(_mm256_srli_epi64(bits, 12), one);
+        _mm256_storeu_pd(out + k, _mm256_sub_pd(_mm256_castsi256_pd(mantissa), _mm256_set1_pd(1.0)));
+    }
+    random_uniform_batch_scalar(seed, ids + k, n - k, counter, out + k);
+}
+#endif
+
+// The batch kernel for this CPU. Call it once before starting any threads.
+static inline Random_Batch random_uniform_batch_kernel(void) {
+    static Random_Batch kernel = NULL;
+    if (kernel == NULL) {
+#ifdef RANDOM_X86
+        kernel = SDL_HasAVX2() ? random_uniform_batch_avx2 : random_uniform_batch_scalar;
+#else
+        kernel = random_uniform_batch_scalar;
+#endif
+    }
+    return kernel;
+}
+
+#endif
@@ -0,0 +1,58 @@
+// Unit direction table shared by the ray tracers.
+//
+// Every tracer fans its rays out at the angles 2 * pi * i / count, so the
+// cos/sin of those angles only depend on the ray count. They are computed
+// once per count here, and moving the light source only changes the origin.
+// ray_directions returns NULL when the table cannot be allocated.
+
+#ifndef RAY_DIRECTIONS_H
+#define RAY_DIRECTIONS_H
+
+#include <math.h>
+#include <stdlib.h>
+
+#define RAY_DIRECTIONS_CACHE 4
+
+struct Ray_Directions {
+    int count;
+    double *dx;
+    double *dy;
+};
+
+static inline const struct Ray_Directions *ray_directions(int count) {
+    static struct Ray_Directions cache[RAY_DIRECTIONS_CACHE];
+    static int cached = 0;
+
+    for (int i = 0; i < cached; i++) {
+        if (cache[i].count == count) return &cache[i];
+    }
+
+    struct Ray_Directions *table;
+    if (cached < RAY_DIRECTIONS_CACHE) {
+        table = &cache[cached++];
+    } else {
+        table = &cache[RAY_DIRECTIONS_CACHE - 1];
+        free(table->dx);
+        free(table->dy);
+    }
+
+    table->count = count;
+    table->dx = (double *)malloc(sizeof(double) * count);
+    table->dy = (double *)malloc(sizeof(double) * count);
+    if (table->dx == NULL || table->dy == NULL) {
+        // The failed slot is always the last one, so drop it from the cache
+        free(table->dx);
+        free(table->dy);
+        *table = (struct Ray_Directions){0};
+        cached--;
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        double angle = ((double)i / count) * 2 * M_PI;
+        table->dx[i] = cos(angle);
+        table->dy[i] = sin(angle);
+    }
+    return table;
+}
+
+#endif
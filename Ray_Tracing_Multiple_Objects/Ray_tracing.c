@@ -1,6 +1,14 @@
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <SDL2/SDL.h>
+#include "../Benchmark/bench.h"
+#include "../Ray_Directions.h"
+#include "../Visibility.h"
+#include "../Ray_Shading.h"
+#include "../Recorder.h"
+#include "../Profiler.h"
+#include "../Snapshot.h"
 
 #define WIDTH 1600
 #define HEIGHT 800
@@ -9,6 +17,10 @@
 #define COLOR_SOURCE 0xFFdefafc
 #define RAYS_NUMBER 2000 // It is computationally hard
 #define MAX_SHADOWS 10
+#define SNAPSHOT_PATH "scene.snap" // Where S saves the scene unless --snapshot says otherwise
+#define CHUNK_LIGHT SNAPSHOT_TAG('L', 'G', 'H', 'T')
+#define CHUNK_OBSTACLES SNAPSHOT_TAG('O', 'B', 'S', 'T')
+#define SCENE_CHUNK_VERSION 1
 
 struct Circle {
     double x;
@@ -18,7 +30,12 @@ struct Circle {
 
 struct Ray {
     double x_start, y_start;
-    double angle;
+    double dx, dy;
+};
+
+struct Hit_Window {
+    int object;
+    int first_step, last_step;
 };
 
 void FillCircle_Outline(SDL_Surface *surface, struct Circle circle, Uint32 color) {
@@ -39,10 +56,18 @@ void FillCircle_Outline(SDL_Surface *surface, struct Circle circle, Uint32 color
     }
 }
 
+// Directions come from the shared table, so moving the source only changes the origin.
+// Without a table (out of memory) the angles are computed per ray.
 void generate_rays(struct Circle circle, struct Ray rays[RAYS_NUMBER]) {
+    PROFILE_SCOPE("generate");
+    const struct Ray_Directions *directions = ray_directions(RAYS_NUMBER);
     for (int i = 0; i < RAYS_NUMBER; i++) {
-        double angle = ((double)i / RAYS_NUMBER) * 2 * M_PI;
-        rays[i] = (struct Ray){circle.x, circle.y, angle};
+        if (directions) {
+            rays[i] = (struct Ray){circle.x, circle.y, directions->dx[i], directions->dy[i]};
+        } else {
+            double angle = ((double)i / RAYS_NUMBER) * 2 * M_PI;
+            rays[i] = (struct Ray){circle.x, circle.y, cos(angle), sin(angle)};
+        }
     }
 }
 
@@ -52,37 +77,71 @@ int RayIntersectsCircle(double x, double y, struct Circle circle) {
     return (dx * dx + dy * dy) <= (circle.r * circle.r);
 }
 
-void FillRays(SDL_Surface *surface, struct Ray rays[RAYS_NUMBER], struct Circle objects[], int num_objects, Uint32 baseColor) {
+// Solves |p + t*d - c|^2 = r^2 for the ray and turns the roots into the range of
+// march steps that can land inside the circle. The range is padded by a small
+// epsilon so the exact per-step test still decides where the ray stops.
+int RayCircleStepWindow(double x, double y, double dx, double dy, struct Circle circle,
+                        int min_step, int max_step, struct Hit_Window *window) {
+    double fx = x - circle.x;
+    double fy = y - circle.y;
+    double r = circle.r + 1e-3;
+    double a = dx * dx + dy * dy;
+    double b = 2 * (fx * dx + fy * dy);
+    double c = fx * fx + fy * fy - r * r;
+    double disc = b * b - 4 * a * c;
+    if (a == 0 || disc < 0) return 0;
+
+    double root = sqrt(disc);
+    double t_enter = floor((-b - root) / (2 * a) - 1e-6);
+    double t_exit = ceil((-b + root) / (2 * a) + 1e-6);
+    if (t_exit < min_step || t_enter > max_step) return 0;
+
+    window->first_step = t_enter < min_step ? min_step : (int)t_enter;
+    window->last_step = t_exit > max_step ? max_step : (int)t_exit;
+    return 1;
+}
+
+// Returns the number of pixels written
+long FillRays(SDL_Surface *surface, struct Ray rays[RAYS_NUMBER], struct Circle objects[], int num_objects, Uint32 baseColor) {
+    PROFILE_SCOPE("trace");
     Uint32 *pixels = (Uint32 *)surface->pixels;
     int pitch = surface->pitch / 4;
+    long pixels_written = 0;
+    Shade_Span shade = ray_shading_kernel();
+    struct Span_Light light = span_light(baseColor, 40000.0, 0.05);
+    int offsets[WIDTH];
+    Uint32 colors[WIDTH];
 
     for (int i = 0; i < RAYS_NUMBER; i++) {
         struct Ray ray = rays[i];
         double x = ray.x_start, y = ray.y_start;
-        double dx = cos(ray.angle), dy = sin(ray.angle);
+        double dx = ray.dx, dy = ray.dy;
+
+        // The first step that can reach any circle, found analytically
+        struct Hit_Window windows[MAX_SHADOWS];
+        int num_windows = 0;
+        int next_test = WIDTH;
+        for (int k = 0; k < num_objects && num_windows < MAX_SHADOWS; k++) {
+            struct Hit_Window *w = &windows[num_windows];
+            if (RayCircleStepWindow(x, y, dx, dy, objects[k], 0, WIDTH - 1, w)) {
+                w->object = k;
+                if (w->first_step < next_test) next_test = w->first_step;
+                num_windows++;
+            }
+        }
 
+        // March to where the ray leaves the screen or stops in a circle, then
+        // shade the whole span at once
+        int num_steps = 0;
         for (int j = 0; j < WIDTH; j++) {
             int ix = (int)x, iy = (int)y;
             if (ix < 0 || ix >= WIDTH || iy < 0 || iy >= HEIGHT) break;
+            offsets[num_steps++] = iy * pitch + ix;
 
-            double distance_squared = (x - ray.x_start) * (x - ray.x_start) + (y - ray.y_start) * (y - ray.y_start);
-            double intensity = 40000.0 / (distance_squared + 1.0);
-            if (intensity > 1.0) intensity = 1.0;
-            if (intensity < 0.05) intensity = 0.0;
-
-            Uint32 r = (baseColor >> 16) & 0xFF;
-            Uint32 g = (baseColor >> 8) & 0xFF;
-            Uint32 b = baseColor & 0xFF;
-
-            r = (Uint32)(r * intensity);
-            g = (Uint32)(g * intensity);
-            b = (Uint32)(b * intensity);
-
-            Uint32 newColor = (r << 16) | (g << 8) | b;
-            pixels[iy * pitch + ix] = newColor;
-
-            for (int k = 0; k < num_objects; k++) {
-                if (RayIntersectsCircle(x, y, objects[k])) {
+            for (int k = 0; j >= next_test && k < num_windows; k++) {
+                struct Hit_Window w = windows[k];
+                if (j >= w.first_step && j <= w.last_step &&
+                    RayIntersectsCircle(x, y, objects[w.object])) {
                     j = WIDTH; // Stop the ray if it intersects any circle
                     break;
                 }
@@ -91,13 +150,71 @@ void FillRays(SDL_Surface *surface, struct Ray rays[RAYS_NUMBER], struct Circle
             x += dx;
             y += dy;
         }
+
+        shade(&light, 0.0f, 0.0f, (float)dx, (float)dy, 0, num_steps, colors);
+        for (int j = 0; j < num_steps; j++) {
+            pixels[offsets[j]] = colors[j];
+        }
+        pixels_written += num_steps;
+    }
+    return pixels_written;
+}
+
+// Writes the light source and obstacles to path. Returns 0 on success.
+int SaveScene(const char *path, struct Circle light, const struct Circle objects[], int num_objects) {
+    struct Snapshot_Writer writer;
+    if (snapshot_begin(&writer, path) != 0) return -1;
+    snapshot_add(&writer, CHUNK_LIGHT, SCENE_CHUNK_VERSION, &light, sizeof(light));
+    snapshot_add(&writer, CHUNK_OBSTACLES, SCENE_CHUNK_VERSION, objects, sizeof(struct Circle) * num_objects);
+    return snapshot_end(&writer);
+}
+
+// Reads a scene saved by SaveScene. Returns 0 on success.
+int LoadScene(const char *path, struct Circle *light, struct Circle objects[], int *num_objects) {
+    struct Snapshot snapshot;
+    if (snapshot_open(&snapshot, path) != 0) return -1;
+    size_t light_size, objects_size;
+    const struct Circle *saved_light = snapshot_chunk(&snapshot, CHUNK_LIGHT, SCENE_CHUNK_VERSION, &light_size);
+    const struct Circle *saved_objects = snapshot_chunk(&snapshot, CHUNK_OBSTACLES, SCENE_CHUNK_VERSION, &objects_size);
+    int valid = saved_light && saved_objects && light_size == sizeof(struct Circle) &&
+                objects_size % sizeof(struct Circle) == 0 && objects_size / sizeof(struct Circle) <= MAX_SHADOWS;
+    if (valid) {
+        *light = *saved_light;
+        *num_objects = (int)(objects_size / sizeof(struct Circle));
+        memcpy(objects, saved_objects, objects_size);
     }
+    snapshot_close(&snapshot);
+    return valid ? 0 : -1;
 }
 
-int main() {
-    SDL_Init(SDL_INIT_VIDEO);
-    SDL_Window *window = SDL_CreateWindow("RAY_TRACING", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
-    SDL_Surface *surface = SDL_GetWindowSurface(window);
+int main(int argc, char *argv[]) {
+    struct Bench bench;
+    int headless = bench_parse_args(&bench, argc, argv);
+    profile_parse_args(argc, argv);
+    // --visibility shades the exact lit region instead of marching the ray fan
+    // --load PATH starts from a saved scene, --snapshot PATH is where S saves it
+    int visibility_mode = 0;
+    const char *load_path = NULL, *snapshot_path = SNAPSHOT_PATH;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--visibility") == 0) visibility_mode = 1;
+        else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) load_path = argv[++i];
+        else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) snapshot_path = argv[++i];
+    }
+
+    SDL_Init(headless ? 0 : SDL_INIT_VIDEO);
+    struct Recorder recorder;
+    if (bench.record && recorder_open(&recorder, bench.record, WIDTH, HEIGHT, RECORD_FPS) != 0) {
+        printf("Could not record to %s\n", bench.record);
+        return 1;
+    }
+    SDL_Window *window = NULL;
+    SDL_Surface *surface;
+    if (headless) {
+        surface = bench_create_surface(WIDTH, HEIGHT);
+    } else {
+        window = SDL_CreateWindow("RAY_TRACING", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
+        surface = SDL_GetWindowSurface(window);
+    }
 
     struct Circle circle = {200, 200, 20};
     struct Circle shadow_circles[MAX_SHADOWS] = {
@@ -108,8 +225,14 @@ int main() {
         {1200, 200, 100}
     };
     int num_shadows = 5;
+    if (load_path && LoadScene(load_path, &circle, shadow_circles, &num_shadows) != 0) {
+        printf("Could not load a scene from %s\n", load_path);
+        return 1;
+    }
 
     struct Ray rays[RAYS_NUMBER];
+    if (load_path) generate_rays(circle, rays);
+    struct Visibility visibility;
     double obstacle_speed_y[MAX_SHADOWS] = {1.0, -0.5, 0.8, -1.2};
 
     int simulation_running = 1;
@@ -125,8 +248,28 @@ int main() {
                 circle.y = event.motion.y;
                 generate_rays(circle, rays);
             }
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_v) {
+                visibility_mode = !visibility_mode;
+            }
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_p) {
+                profile_toggle_overlay();
+            }
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_s) {
+                if (SaveScene(snapshot_path, circle, shadow_circles, num_shadows) == 0) {
+                    printf("Saved the scene to %s\n", snapshot_path);
+                } else {
+                    printf("Could not save the scene to %s\n", snapshot_path);
+                }
+            }
+        }
+
+        if (headless) {
+            bench_frame_begin(&bench);
+            bench_light_position(&bench, WIDTH, HEIGHT, &circle.x, &circle.y);
+            generate_rays(circle, rays);
         }
 
+        Uint64 rasterize_start = profile_now();
         SDL_FillRect(surface, NULL, COLOR_BLACK);
 
         for (int i = 0; i < num_shadows; i++) {
@@ -137,13 +280,41 @@ int main() {
             //     obstacle_speed_y[i] = -obstacle_speed_y[i];
             // }
         }
+        profile_record("rasterize", rasterize_start);
 
-        FillRays(surface, rays, shadow_circles, num_shadows, COLOR_SOURCE);
+        long pixels_written;
+        if (visibility_mode) {
+            PROFILE_SCOPE("visibility");
+            visibility_begin(&visibility, circle.x, circle.y);
+            for (int i = 0; i < num_shadows; i++) {
+                visibility_add(&visibility, shadow_circles[i].x, shadow_circles[i].y, shadow_circles[i].r);
+            }
+            pixels_written = FillVisibility(surface, &visibility, COLOR_SOURCE);
+        } else {
+            pixels_written = FillRays(surface, rays, shadow_circles, num_shadows, COLOR_SOURCE);
+        }
+        profile_draw_surface(surface);
 
-        SDL_UpdateWindowSurface(window);
-        SDL_Delay(1);
+        if (headless) {
+            if (bench.record) recorder_push(&recorder, surface);
+            bench_frame_end(&bench, visibility_mode ? 0 : RAYS_NUMBER, pixels_written);
+            simulation_running = bench_running(&bench);
+        } else {
+            Uint64 present_start = profile_now();
+            SDL_UpdateWindowSurface(window);
+            profile_record("present", present_start);
+            SDL_Delay(1);
+        }
+        profile_frame();
     }
+    profile_shutdown();
 
+    if (headless) {
+        if (bench.record) recorder_close(&recorder, bench.record);
+        bench_report(&bench, visibility_mode ? "Ray_Tracing_Multiple_Objects --visibility" : "Ray_Tracing_Multiple_Objects");
+        bench_free(&bench);
+        SDL_FreeSurface(surface);
+    }
     SDL_DestroyWindow(window);
     SDL_Quit();
     return 0;
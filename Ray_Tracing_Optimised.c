@@ -2,8 +2,14 @@
 // run ./Ray_Tracing
 
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <SDL2/SDL.h>
+#include "Benchmark/bench.h"
+#include "Ray_Directions.h"
+#include "Visibility.h"
+#include "Recorder.h"
+#include "Profiler.h"
 
 #define WIDTH 1600
 #define HEIGHT 800
@@ -21,7 +27,7 @@ struct Circle{
 
 struct Ray{
     double x_start, y_start;
-    double angle;
+    double dx, dy;
 };
 
 void FillCircle(SDL_Surface *surface, struct Circle circle, Uint32 color){
@@ -42,20 +48,31 @@ void FillCircle(SDL_Surface *surface, struct Circle circle, Uint32 color){
     }
 }
 
+// Directions come from the shared table, so moving the source only changes the origin.
+// Without a table (out of memory) the angles are computed per ray.
 void generate_rays(struct Circle circle, struct Ray rays [RAYS_NUMBER]){
+    PROFILE_SCOPE("generate");
+    const struct Ray_Directions *directions = ray_directions(RAYS_NUMBER);
     for (int i = 0; i < RAYS_NUMBER; i++){
-        double angle = ((double)i / RAYS_NUMBER) * 2 * M_PI;
-        rays[i] = (struct Ray){circle.x, circle.y, angle};
+        if (directions){
+            rays[i] = (struct Ray){circle.x, circle.y, directions->dx[i], directions->dy[i]};
+        } else {
+            double angle = ((double)i / RAYS_NUMBER) * 2 * M_PI;
+            rays[i] = (struct Ray){circle.x, circle.y, cos(angle), sin(angle)};
+        }
     }
 }
 
-void FillRays(SDL_Surface *surface, struct Ray rays[RAYS_NUMBER], struct Circle object, Uint32 color){
+// Returns the number of pixels written
+long FillRays(SDL_Surface *surface, struct Ray rays[RAYS_NUMBER], struct Circle object, Uint32 color){
+    PROFILE_SCOPE("trace");
     Uint32 *pixels = (Uint32 *)surface->pixels;
     int pitch = surface->pitch / 4;
+    long pixels_written = 0;
     for (int i = 0; i < RAYS_NUMBER; i++){
         struct Ray ray = rays[i];
         double x = ray.x_start, y = ray.y_start;
-        double dx = cos(ray.angle), dy = sin(ray.angle);
+        double dx = ray.dx, dy = ray.dy;
         double x_c = object.x, y_c = object.y;
         double radius_squared = object.r * object.r;
         
@@ -63,21 +80,44 @@ void FillRays(SDL_Surface *surface, struct Ray rays[RAYS_NUMBER], struct Circle
             int ix = (int)x, iy = (int)y;
             if (ix < 0 || ix >= WIDTH || iy < 0 || iy >= HEIGHT) break;
             pixels[iy * pitch + ix] = color;
+            pixels_written++;
             if (((x - x_c) * (x - x_c) + (y - y_c) * (y - y_c)) <= radius_squared) break;
             x += dx; y += dy;
         }
     }
+    return pixels_written;
 }
 
-int main(){
-    SDL_Init(SDL_INIT_VIDEO);
-    SDL_Window *window = SDL_CreateWindow("RAY_TRACING", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
-    SDL_Surface *surface = SDL_GetWindowSurface(window);
+int main(int argc, char *argv[]){
+    struct Bench bench;
+    int headless = bench_parse_args(&bench, argc, argv);
+    profile_parse_args(argc, argv);
+    // --visibility shades the exact lit region instead of marching the ray fan
+    int visibility_mode = 0;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--visibility") == 0) visibility_mode = 1;
+    }
+
+    SDL_Init(headless ? 0 : SDL_INIT_VIDEO);
+    struct Recorder recorder;
+    if (bench.record && recorder_open(&recorder, bench.record, WIDTH, HEIGHT, RECORD_FPS) != 0){
+        printf("Could not record to %s\n", bench.record);
+        return 1;
+    }
+    SDL_Window *window = NULL;
+    SDL_Surface *surface;
+    if (headless){
+        surface = bench_create_surface(WIDTH, HEIGHT);
+    } else {
+        window = SDL_CreateWindow("RAY_TRACING", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
+        surface = SDL_GetWindowSurface(window);
+    }
 
     struct Circle circle = {200, 200, 40};
     struct Circle shadow_circle = {1200, 500, 160};
     SDL_Rect erase_rect = {0, 0, WIDTH, HEIGHT};
     struct Ray rays[RAYS_NUMBER];
+    struct Visibility visibility;
     double obstacle_speed_y = 0.2;
 
     int simulation_running = 1;
@@ -92,22 +132,61 @@ int main(){
                 circle.y = event.motion.y;
                 generate_rays(circle, rays);
             }
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_v){
+                visibility_mode = !visibility_mode;
+            }
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_p){
+                profile_toggle_overlay();
+            }
         }
 
+        if (headless){
+            bench_frame_begin(&bench);
+            bench_light_position(&bench, WIDTH, HEIGHT, &circle.x, &circle.y);
+            generate_rays(circle, rays);
+        }
+
+        Uint64 rasterize_start = profile_now();
         SDL_FillRect(surface, &erase_rect, COLOR_BLACK);
         FillCircle(surface, shadow_circle, COLOR_WHITE);
-        FillRays(surface, rays, shadow_circle, COLOR_SOURCE);
+        profile_record("rasterize", rasterize_start);
+        long pixels_written;
+        if (visibility_mode){
+            PROFILE_SCOPE("visibility");
+            visibility_begin(&visibility, circle.x, circle.y);
+            visibility_add(&visibility, shadow_circle.x, shadow_circle.y, shadow_circle.r);
+            pixels_written = FillVisibility(surface, &visibility, COLOR_SOURCE);
+        } else {
+            pixels_written = FillRays(surface, rays, shadow_circle, COLOR_SOURCE);
+        }
         FillCircle(surface, circle, COLOR_WHITE);
+        profile_draw_surface(surface);
 
         shadow_circle.y += obstacle_speed_y;
         if (shadow_circle.y - shadow_circle.r < 0 || shadow_circle.y + shadow_circle.r > HEIGHT){
             obstacle_speed_y = -obstacle_speed_y;
         }
 
-        SDL_UpdateWindowSurface(window);
-        SDL_Delay(1);
+        if (headless){
+            if (bench.record) recorder_push(&recorder, surface);
+            bench_frame_end(&bench, visibility_mode ? 0 : RAYS_NUMBER, pixels_written);
+            simulation_running = bench_running(&bench);
+        } else {
+            Uint64 present_start = profile_now();
+            SDL_UpdateWindowSurface(window);
+            profile_record("present", present_start);
+            SDL_Delay(1);
+        }
+        profile_frame();
+    }
+    profile_shutdown();
+
+    if (headless){
+        if (bench.record) recorder_close(&recorder, bench.record);
+        bench_report(&bench, visibility_mode ? "Ray_Tracing_Optimised --visibility" : "Ray_Tracing_Optimised");
+        bench_free(&bench);
+        SDL_FreeSurface(surface);
     }
-    
     SDL_DestroyWindow(window);
     SDL_Quit();
     return 0;
@@ -4,6 +4,9 @@
 #include <stdio.h>
 #include <math.h>
 #include <SDL2/SDL.h>
+#include "Benchmark/bench.h"
+#include "Recorder.h"
+#include "Profiler.h"
 
 #define WIDTH 1600
 #define HEIGHT 800
@@ -38,13 +41,17 @@ void FillCircle(SDL_Surface *surface, struct Circle circle, Uint32 color){
     }
 }
 void generate_rays(struct Circle circle, struct Ray rays [RAYS_NUMBER]){
+    PROFILE_SCOPE("generate");
     for (int i=0; i<RAYS_NUMBER; i++){
         double angle = ((double)i/RAYS_NUMBER)* 2 * M_PI;
         struct Ray ray = {circle.x, circle.y, angle};
         rays[i] = ray;
     }
 }
-void FillRays(SDL_Surface *surface, struct Ray rays [RAYS_NUMBER], struct Circle object, Uint32 color){
+// Returns the number of pixels written
+long FillRays(SDL_Surface *surface, struct Ray rays [RAYS_NUMBER], struct Circle object, Uint32 color){
+    PROFILE_SCOPE("trace");
+    long pixels_written = 0;
     for(int i=0; i<RAYS_NUMBER; i++){
         struct Ray ray  = rays[i];
 
@@ -66,6 +73,7 @@ void FillRays(SDL_Surface *surface, struct Ray rays [RAYS_NUMBER], struct Circle
             
             SDL_Rect pixel = (SDL_Rect) {x_draw, y_draw, 2, 2};
             SDL_FillRect(surface, &pixel, color);
+            pixels_written += pixel.w * pixel.h;
 
             if(x_draw < 0 || x_draw > WIDTH) {
                 end_of_screen = 1;
@@ -79,15 +87,29 @@ void FillRays(SDL_Surface *surface, struct Ray rays [RAYS_NUMBER], struct Circle
             }
         }
     }
+    return pixels_written;
 }
 
 
-int main(){
-    
-    SDL_Init(SDL_INIT_VIDEO);
-    SDL_Window *window = SDL_CreateWindow("RAY_TRACING", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
+int main(int argc, char *argv[]){
+    struct Bench bench;
+    int headless = bench_parse_args(&bench, argc, argv);
+    profile_parse_args(argc, argv);
 
-    SDL_Surface *surface = SDL_GetWindowSurface(window);
+    SDL_Init(headless ? 0 : SDL_INIT_VIDEO);
+    struct Recorder recorder;
+    if (bench.record && recorder_open(&recorder, bench.record, WIDTH, HEIGHT, RECORD_FPS) != 0){
+        printf("Could not record to %s\n", bench.record);
+        return 1;
+    }
+    SDL_Window *window = NULL;
+    SDL_Surface *surface;
+    if (headless){
+        surface = bench_create_surface(WIDTH, HEIGHT);
+    } else {
+        window = SDL_CreateWindow("RAY_TRACING", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
+        surface = SDL_GetWindowSurface(window);
+    }
 
 
     struct Circle circle = {200, 200, 40};
@@ -108,13 +130,25 @@ int main(){
                 circle.y = event.motion.y;
                 generate_rays(circle, rays);
             }
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_p){
+                profile_toggle_overlay();
+            }
+        }
+
+        if (headless){
+            bench_frame_begin(&bench);
+            bench_light_position(&bench, WIDTH, HEIGHT, &circle.x, &circle.y);
+            generate_rays(circle, rays);
         }
 
+        Uint64 rasterize_start = profile_now();
         SDL_FillRect(surface, &erase_rect, COLOR_BLACK);
         FillCircle(surface, shadow_circle, COLOR_WHITE);
+        profile_record("rasterize", rasterize_start);
 
-        FillRays(surface, rays, shadow_circle, COLOR_SOURCE);
+        long pixels_written = FillRays(surface, rays, shadow_circle, COLOR_SOURCE);
         FillCircle(surface, circle, COLOR_WHITE);
+        profile_draw_surface(surface);
 
         shadow_circle.y += obstacle_speed_y;
         if (shadow_circle.y-shadow_circle.r < 0){
@@ -124,8 +158,25 @@ int main(){
             obstacle_speed_y = -obstacle_speed_y;
         }
 
-        SDL_UpdateWindowSurface(window);
-        SDL_Delay(1);
+        if (headless){
+            if (bench.record) recorder_push(&recorder, surface);
+            bench_frame_end(&bench, RAYS_NUMBER, pixels_written);
+            simulation_running = bench_running(&bench);
+        } else {
+            Uint64 present_start = profile_now();
+            SDL_UpdateWindowSurface(window);
+            profile_record("present", present_start);
+            SDL_Delay(1);
+        }
+        profile_frame();
+    }
+    profile_shutdown();
+
+    if (headless){
+        if (bench.record) recorder_close(&recorder, bench.record);
+        bench_report(&bench, "Ray_Tracing_Unoptimised");
+        bench_free(&bench);
+        SDL_FreeSurface(surface);
     }
     return 0;    
 }
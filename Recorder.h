@@ -0,0 +1,195 @@
+// Offline video recorder shared by the ray tracers.
+//
+//   ./Ray_Tracing --record out.y4m --frames 600
+//
+// renders headless along the scripted benchmark light path and writes every
+// frame to out.y4m. Each rendered surface is copied into a ring of frame
+// buffers allocated up front; a writer thread converts them and does all the
+// file I/O, so the render loop only waits when the whole ring is still queued.
+//
+// The target picks the format:
+//   *.y4m       YUV4MPEG2, 4:2:0, readable by ffmpeg and most players
+//   |command    the same Y4M stream piped into command, e.g.
+//               "|ffmpeg -y -f yuv4mpegpipe -i - out.mp4"
+//   any other   raw RGBA bytes, frame after frame
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+#define RECORD_RING_FRAMES 8
+#define RECORD_FPS 60
+
+enum { RECORD_Y4M, RECORD_RGBA };
+
+struct Recorder {
+    FILE *out;
+    int piped;
+    int format;
+    int width, height;
+    Uint32 *frames[RECORD_RING_FRAMES];
+    Uint8 *scratch;             // one converted frame
+    long pushed, written;
+    SDL_atomic_t stop;          // set by recorder_close, read by the writer
+    int failed;
+    SDL_sem *free_slots, *queued;
+    SDL_Thread *thread;
+};
+
+static inline int recorder_ends_with(const char *text, const char *suffix) {
+    size_t n = strlen(text), m = strlen(suffix);
+    return n >= m && strcmp(text + n - m, suffix) == 0;
+}
+
+// BT.601 studio range, the same integer approximation most encoders use
+static inline void recorder_yuv420(const struct Recorder *rec, const Uint32 *frame, Uint8 *out) {
+    int w = rec->width, h = rec->height;
+    int cw = (w + 1) / 2, ch = (h + 1) / 2;
+    Uint8 *plane_y = out, *plane_u = out + w * h, *plane_v = plane_u + cw * ch;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            Uint32 p = frame[y * w + x];
+            int r = (p >> 16) & 0xFF, g = (p >> 8) & 0xFF, b = p & 0xFF;
+            plane_y[y * w + x] = (Uint8)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        }
+    }
+    // Chroma from the average of each 2x2 block
+    for (int y = 0; y < ch; y++) {
+        for (int x = 0; x < cw; x++) {
+            int r = 0, g = 0, b = 0, n = 0;
+            for (int dy = 0; dy < 2 && 2 * y + dy < h; dy++) {
+                for (int dx = 0; dx < 2 && 2 * x + dx < w; dx++) {
+                    Uint32 p = frame[(2 * y + dy) * w + 2 * x + dx];
+                    r += (p >> 16) & 0xFF;
+                    g += (p >> 8) & 0xFF;
+                    b += p & 0xFF;
+                    n++;
+                }
+            }
+            r /= n;
+            g /= n;
+            b /= n;
+            plane_u[y * cw + x] = (Uint8)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            plane_v[y * cw + x] = (Uint8)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+}
+
+static inline void recorder_rgba(const struct Recorder *rec, const Uint32 *frame, Uint8 *out) {
+    for (int i = 0; i < rec->width * rec->height; i++) {
+        Uint32 p = frame[i];
+        out[4 * i + 0] = (p >> 16) & 0xFF;
+        out[4 * i + 1] = (p >> 8) & 0xFF;
+        out[4 * i + 2] = p & 0xFF;
+        out[4 * i + 3] = 0xFF;
+    }
+}
+
+static inline int recorder_writer(void *data) {
+    struct Recorder *rec = (struct Recorder *)data;
+    while (1) {
+        SDL_SemWait(rec->queued);
+        if (SDL_AtomicGet(&rec->stop) && rec->written == rec->pushed) break;
+
+        const Uint32 *frame = rec->frames[rec->written % RECORD_RING_FRAMES];
+        size_t size;
+        if (rec->format == RECORD_Y4M) {
+            recorder_yuv420(rec, frame, rec->scratch);
+            size = (size_t)rec->width * rec->height + 2 * (size_t)((rec->width + 1) / 2) * ((rec->height + 1) / 2);
+            if (fputs("FRAME\n", rec->out) == EOF) rec->failed = 1;
+        } else {
+            recorder_rgba(rec, frame, rec->scratch);
+            size = (size_t)rec->width * rec->height * 4;
+        }
+        if (fwrite(rec->scratch, 1, size, rec->out) != size) rec->failed = 1;
+        rec->written++;
+        SDL_SemPost(rec->free_slots);
+    }
+    return 0;
+}
+
+// Closes the target and frees the ring. Returns the pclose/fclose status.
+static inline int recorder_release(struct Recorder *rec) {
+    int status = 0;
+    if (rec->out) status = rec->piped ? pclose(rec->out) : fclose(rec->out);
+    rec->out = NULL;
+    for (int i = 0; i < RECORD_RING_FRAMES; i++) {
+        free(rec->frames[i]);
+        rec->frames[i] = NULL;
+    }
+    free(rec->scratch);
+    rec->scratch = NULL;
+    if (rec->free_slots) SDL_DestroySemaphore(rec->free_slots);
+    if (rec->queued) SDL_DestroySemaphore(rec->queued);
+    rec->free_slots = rec->queued = NULL;
+    return status;
+}
+
+static inline int recorder_abort(struct Recorder *rec) {
+    recorder_release(rec);
+    return -1;
+}
+
+// Opens target and starts the writer thread. Returns 0 on success; on failure
+// nothing is left open and recorder_close need not be called.
+static inline int recorder_open(struct Recorder *rec, const char *target, int width, int height, int fps) {
+    memset(rec, 0, sizeof(*rec));
+    rec->width = width;
+    rec->height = height;
+    rec->piped = target[0] == '|';
+    rec->format = rec->piped || recorder_ends_with(target, ".y4m") ? RECORD_Y4M : RECORD_RGBA;
+    rec->out = rec->piped ? popen(target + 1, "w") : fopen(target, "wb");
+    if (rec->out == NULL) return -1;
+
+    for (int i = 0; i < RECORD_RING_FRAMES; i++) {
+        rec->frames[i] = (Uint32 *)malloc((size_t)width * height * sizeof(Uint32));
+        if (rec->frames[i] == NULL) return recorder_abort(rec);
+    }
+    rec->scratch = (Uint8 *)malloc((size_t)width * height * 4);
+    if (rec->scratch == NULL) return recorder_abort(rec);
+
+    if (rec->format == RECORD_Y4M) {
+        fprintf(rec->out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, fps);
+    }
+    rec->free_slots = SDL_CreateSemaphore(RECORD_RING_FRAMES);
+    rec->queued = SDL_CreateSemaphore(0);
+    if (rec->free_slots == NULL || rec->queued == NULL) return recorder_abort(rec);
+    rec->thread = SDL_CreateThread(recorder_writer, "RecorderWriter", rec);
+    return rec->thread == NULL ? recorder_abort(rec) : 0;
+}
+
+// Queues a copy of the surface. Only waits when every ring slot is still queued.
+static inline void recorder_push(struct Recorder *rec, SDL_Surface *surface) {
+    SDL_SemWait(rec->free_slots);
+    Uint32 *frame = rec->frames[rec->pushed % RECORD_RING_FRAMES];
+    const Uint8 *pixels = (const Uint8 *)surface->pixels;
+    for (int y = 0; y < rec->height; y++) {
+        memcpy(frame + y * rec->width, pixels + y * surface->pitch, rec->width * sizeof(Uint32));
+    }
+    rec->pushed++;
+    SDL_SemPost(rec->queued);
+}
+
+// Drains the ring, closes the target and prints how many frames were written.
+// Returns 0 when every frame reached the target.
+static inline int recorder_close(struct Recorder *rec, const char *target) {
+    if (rec->thread) {
+        SDL_AtomicSet(&rec->stop, 1);
+        SDL_SemPost(rec->queued);
+        SDL_WaitThread(rec->thread, NULL);
+    }
+    if (recorder_release(rec) != 0) rec->failed = 1;
+    printf("Recorded %ld frames to %s%s\n", rec->written, target, rec->failed ? " (write failed)" : "");
+    return rec->failed ? -1 : 0;
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include <bits/stdc++.h>
 #include <SDL2/SDL.h>
+#include "../Profiler.h"
 
 
 #define WHITE {255, 255, 255, 255}
@@ -10,18 +11,30 @@
 #define BODY_SIZE 10
 #define SHM_POINT_SIZE 20
 #define CELL_SIZE 40
-#define NUM_BODIES 1000/CELL_SIZE - 1// Number of SHM bodies
+#define NUM_BODIES (1000/CELL_SIZE - 1) // Default number of SHM bodies
+#define WAVE_LEFT (16*CELL_SIZE)          // x of the first body
+#define WAVE_SPAN ((NUM_BODIES - 1) * CELL_SIZE) // width the bodies are spread over
+#define MAX_MODES 8
+#define RENORMALIZE_FRAMES 1024 // Frames between pulling the phasors back onto the unit circle
+#define PHYSICS_HZ 240          // Simulation steps per second, independent of the render rate
+#define MAX_FRAME_TIME 0.25     // Longest wall-clock gap simulated at once
 
 using namespace std;
 
-struct Point{
+struct SHM_Point{
     int x;
     int y;
 };
 
-struct SHM_Point{
-    int x;
-    int y;
+// One frequency of the wave. Body i moves as amplitude * sin(omega * t + i * phase_step),
+// the imaginary part of its phasor e^{i(omega * t + i * phase_step)}. Advancing time by
+// dt multiplies every phasor by the same rotation e^{i * omega * dt}, so the bodies need
+// no sin or cos after start-up.
+struct Wave_Mode {
+    double amplitude;
+    double omega;               // Angular frequency in rad/s
+    double phase_step;          // Phase difference between neighbouring bodies
+    vector<double> re, im;      // Phasor of every body
 };
 
 struct Circle {
@@ -54,28 +67,92 @@ void draw_grid(SDL_Renderer *renderer) {
     }
 }
 
-void FillCircle_Outline(SDL_Renderer *renderer, struct Circle circle, SDL_Color color) {
+// Points of the reference circle outline, rasterized once and drawn every frame
+vector<SDL_Point> circle_outline(struct Circle circle) {
+    vector<SDL_Point> outline;
     int x0 = (int)circle.x;
     int y0 = (int)circle.y;
     int radius = (int)circle.r;
     int rSquared = radius * radius;
     int thickness = 400; // Adjust thickness as needed
 
-    SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
-
     for (int x = -radius; x <= radius; x++) {
         int height = (int)sqrt(rSquared - x * x);
         for (int y = -height; y <= height; y++) {
             int distanceSquared = x * x + y * y;
             if (distanceSquared >= rSquared - thickness && distanceSquared <= rSquared + thickness) {
-                SDL_RenderDrawPoint(renderer, x0 + x, y0 + y);
+                outline.push_back({x0 + x, y0 + y});
             }
         }
     }
+    return outline;
 }
 
+void init_mode(Wave_Mode &mode, int num_bodies) {
+    mode.re.resize(num_bodies);
+    mode.im.resize(num_bodies);
+    for (int i = 0; i < num_bodies; i++) {
+        mode.re[i] = cos(i * mode.phase_step);
+        mode.im[i] = sin(i * mode.phase_step);
+    }
+}
+
+// Rotates every phasor of the mode by angle: one complex multiply per body
+void advance_mode(Wave_Mode &mode, double angle) {
+    double c = cos(angle), s = sin(angle);
+    double *re = mode.re.data(), *im = mode.im.data();
+    size_t n = mode.re.size();
+    for (size_t i = 0; i < n; i++) {
+        double r = re[i] * c - im[i] * s;
+        im[i] = re[i] * s + im[i] * c;
+        re[i] = r;
+    }
+}
+
+// Rounding makes the phasors drift off the unit circle very slowly
+void renormalize_mode(Wave_Mode &mode) {
+    for (size_t i = 0; i < mode.re.size(); i++) {
+        double scale = 1.0 / sqrt(mode.re[i] * mode.re[i] + mode.im[i] * mode.im[i]);
+        mode.re[i] *= scale;
+        mode.im[i] *= scale;
+    }
+}
+
+// Vertical offset of body i, with every mode rotated on by (qc[k], qs[k]) to the render time
+double displacement(const vector<Wave_Mode> &modes, const double *qc, const double *qs, int i) {
+    double y = 0;
+    for (size_t k = 0; k < modes.size(); k++) {
+        y += modes[k].amplitude * (modes[k].re[i] * qs[k] + modes[k].im[i] * qc[k]);
+    }
+    return y;
+}
+
+int main(int argc, char *argv[]) {
+    // --profile shows the frame profiler overlay, --trace PATH writes a Chrome trace at exit
+    profile_parse_args(argc, argv);
+
+    // --bodies N: number of oscillators, up to millions
+    // --wave AMPLITUDE:OMEGA:PHASE_STEP: add a mode to the superposition (repeatable)
+    int num_bodies = NUM_BODIES;
+    vector<Wave_Mode> modes;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bodies") == 0 && i + 1 < argc) {
+            num_bodies = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--wave") == 0 && i + 1 < argc) {
+            Wave_Mode mode = {};
+            if (sscanf(argv[++i], "%lf:%lf:%lf", &mode.amplitude, &mode.omega, &mode.phase_step) != 3) {
+                cerr << "Expected --wave AMPLITUDE:OMEGA:PHASE_STEP, got " << argv[i] << endl;
+                return 1;
+            }
+            if (modes.size() < MAX_MODES) modes.push_back(mode);
+        }
+    }
+    if (modes.empty()) {
+        // Amplitude 160, and the old -0.05 rad per frame at 60 FPS
+        modes.push_back({160, -0.05 * 60, 0.5, {}, {}});
+    }
+    for (Wave_Mode &mode : modes) init_mode(mode, num_bodies);
 
-int main() {
     // Initialize SDL
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         cerr << "SDL Initialization Failed: " << SDL_GetError() << endl;
@@ -87,28 +164,25 @@ int main() {
     SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
     
     // SHM Parameters
-    int EQUILIBRIUM_X = WIDTH / 2;      // Equilibrium point (horizontal)
     int EQUILIBRIUM_Y = HEIGHT / 2;      // Start vertical position
-    double amplitude = 160;       // Amplitude of motion
-    double omega = -0.05;          // Angular frequency (speed of oscillation)
-    struct Point points[NUM_BODIES];
+    double amplitude = modes[0].amplitude; // Radius of the reference circle
+    vector<SDL_Point> points(num_bodies);
     struct SHM_Point shm_point;
-    struct Circle SHM_circle = {200, 200, 40};
-    // Array to store phase offsets for each body
-    double phase_offsets[NUM_BODIES];
+    struct Circle SHM_circle = {8.0*CELL_SIZE, (double)EQUILIBRIUM_Y, amplitude};
+    vector<SDL_Point> outline = circle_outline(SHM_circle);
+    // Columns of the envelope drawn when there are more bodies than pixels
+    vector<int> column_top(WAVE_SPAN + 1), column_bottom(WAVE_SPAN + 1);
+    vector<double> offsets(num_bodies);
+    double spacing = num_bodies > 1 ? (double)WAVE_SPAN / (num_bodies - 1) : 0;
 
     SDL_Color white_color = WHITE;
 
-    // Initialize phase offsets to create a wave pattern
-    for (int i = 0; i < NUM_BODIES; i++) {
-        phase_offsets[i] = i * 0.5; // Spread out phases
-    }
-
-    Uint32 frameStart, frameEnd, frameTime;
-    double fps;
-
-    // Time counter for SHM
-    double t = 0;
+    // Simulation time advances in fixed steps of dt
+    double dt = 1.0 / PHYSICS_HZ;
+    double accumulator = 0;
+    double frequency = (double)SDL_GetPerformanceFrequency();
+    Uint64 last_time = SDL_GetPerformanceCounter();
+    long frames = 0;
 
     // Main loop
     bool simulation_running = true;
@@ -116,9 +190,6 @@ int main() {
 
     while (simulation_running) {
         // Background color (black)
-
-        frameStart = SDL_GetTicks();
-
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
 
@@ -127,56 +198,123 @@ int main() {
             if (event.type == SDL_QUIT) {
                 simulation_running = false; // Exit loop on window close
             }
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_p) {
+                profile_toggle_overlay();
+            }
         }
+        Uint64 now = SDL_GetPerformanceCounter();
+        double elapsed = (now - last_time) / frequency;
+        last_time = now;
+        accumulator += elapsed > MAX_FRAME_TIME ? MAX_FRAME_TIME : elapsed;
+        {
+            PROFILE_SCOPE("integrate");
+            // All the steps of this frame are one rotation per mode
+            int steps = 0;
+            while (accumulator >= dt) {
+                steps++;
+                accumulator -= dt;
+            }
+            bool renormalize = ++frames % RENORMALIZE_FRAMES == 0;
+            for (Wave_Mode &mode : modes) {
+                if (steps > 0) advance_mode(mode, mode.omega * steps * dt);
+                if (renormalize) renormalize_mode(mode);
+            }
+        }
+        // Render between the last two steps; the motion is analytic, so this is exact
+        double qc[MAX_MODES], qs[MAX_MODES];
+        for (size_t k = 0; k < modes.size(); k++) {
+            qc[k] = cos(modes[k].omega * accumulator);
+            qs[k] = sin(modes[k].omega * accumulator);
+        }
+
+        Uint64 rasterize_start = profile_now();
         draw_grid(renderer);
         SDL_SetRenderDrawColor(renderer, white_color.r, white_color.g, white_color.b, white_color.a);
         SDL_RenderDrawLine(renderer, 0, HEIGHT/2, WIDTH, HEIGHT/2);
         SDL_RenderDrawLine(renderer, WIDTH/2, 0, WIDTH/2, HEIGHT);
-        // Draw multiple SHM bodies
-        for (int i = 0; i < NUM_BODIES; i++) {
-            points[i].y = EQUILIBRIUM_Y + static_cast<int>(amplitude * sin(omega * t + phase_offsets[i]));
-            points[i].x = 16*CELL_SIZE + i * CELL_SIZE; // Vertical spacing between bodies
 
+        points[0].x = WAVE_LEFT;
+        points[0].y = EQUILIBRIUM_Y + static_cast<int>(displacement(modes, qc, qs, 0));
+        if (spacing >= BODY_SIZE) {
+            // Few bodies: each one with its stem, linked to the next
+            for (int i = 0; i < num_bodies; i++) {
+                points[i].y = EQUILIBRIUM_Y + static_cast<int>(displacement(modes, qc, qs, i));
+                points[i].x = WAVE_LEFT + static_cast<int>(i * spacing);
+            }
+            SDL_SetRenderDrawColor(renderer, white_color.r, white_color.g, white_color.b, white_color.a);
+            for (int i = 0; i < num_bodies; i++) {
+                SDL_RenderDrawLine(renderer, points[i].x, points[i].y, points[i].x, HEIGHT/2);
+                draw_shape(renderer, points[i].x, points[i].y, white_color);
+                if (i<num_bodies-1){
+                    SDL_SetRenderDrawColor(renderer, white_color.r, white_color.g, white_color.b, white_color.a);
+                    SDL_RenderDrawLine(renderer, points[i].x, points[i].y, points[i+1].x, points[i+1].y);
+                }
+            }
+        } else if (spacing >= 1) {
+            // At most one body per pixel column: a single polyline
+            for (int i = 0; i < num_bodies; i++) {
+                points[i].y = EQUILIBRIUM_Y + static_cast<int>(displacement(modes, qc, qs, i));
+                points[i].x = WAVE_LEFT + static_cast<int>(i * spacing);
+            }
             SDL_SetRenderDrawColor(renderer, white_color.r, white_color.g, white_color.b, white_color.a);
-            SDL_RenderDrawLine(renderer, points[i].x, points[i].y, points[i].x, HEIGHT/2);
-            draw_shape(renderer, points[i].x, points[i].y, white_color);
+            SDL_RenderDrawLines(renderer, points.data(), num_bodies);
+        } else {
+            // More bodies than pixels: draw the range each column covers
+            // Mode by mode, so the inner loops stay simple enough to vectorize
+            fill(offsets.begin(), offsets.end(), 0.0);
+            for (size_t k = 0; k < modes.size(); k++) {
+                const double *re = modes[k].re.data(), *im = modes[k].im.data();
+                double a = modes[k].amplitude, c = qc[k], s = qs[k];
+                for (int i = 0; i < num_bodies; i++) offsets[i] += a * (re[i] * s + im[i] * c);
+            }
+            fill(column_top.begin(), column_top.end(), HEIGHT);
+            fill(column_bottom.begin(), column_bottom.end(), -1);
+            int column = 0;
+            double next_column = 1 / spacing;
+            for (int i = 0; i < num_bodies; i++) {
+                if (i >= next_column) {
+                    column = static_cast<int>(i * spacing);
+                    next_column = (column + 1) / spacing;
+                }
+                int y = EQUILIBRIUM_Y + static_cast<int>(offsets[i]);
+                column_top[column] = min(column_top[column], y);
+                column_bottom[column] = max(column_bottom[column], y);
+            }
+            SDL_SetRenderDrawColor(renderer, white_color.r, white_color.g, white_color.b, white_color.a);
+            for (int column = 0; column <= WAVE_SPAN; column++) {
+                if (column_bottom[column] < 0) continue;
+                SDL_RenderDrawLine(renderer, WAVE_LEFT + column, column_top[column],
+                                   WAVE_LEFT + column, column_bottom[column]);
+            }
+        }
 
-            SHM_circle.x = 8*CELL_SIZE;
-            SHM_circle.y = EQUILIBRIUM_Y;
-            SHM_circle.r = amplitude;
-            FillCircle_Outline(renderer, SHM_circle, white_color);
+        // The reference circle follows the first body of the first mode
+        SDL_SetRenderDrawColor(renderer, white_color.r, white_color.g, white_color.b, white_color.a);
+        SDL_RenderDrawPoints(renderer, outline.data(), static_cast<int>(outline.size()));
 
-            shm_point.x = SHM_circle.x + SHM_circle.r * cos(omega * t + phase_offsets[0]);
-            shm_point.y = SHM_circle.y + SHM_circle.r * sin(omega * t + phase_offsets[0]);
-            draw_point(renderer, shm_point.x, shm_point.y);
+        shm_point.x = SHM_circle.x + SHM_circle.r * (modes[0].re[0] * qc[0] - modes[0].im[0] * qs[0]);
+        shm_point.y = SHM_circle.y + SHM_circle.r * (modes[0].re[0] * qs[0] + modes[0].im[0] * qc[0]);
+        draw_point(renderer, shm_point.x, shm_point.y);
 
-            SDL_SetRenderDrawColor(renderer, white_color.r-100, white_color.g-100, white_color.b-100, white_color.a);
-            SDL_RenderDrawLine(renderer, shm_point.x, shm_point.y, points[0].x, points[0].y);
+        SDL_SetRenderDrawColor(renderer, white_color.r-100, white_color.g-100, white_color.b-100, white_color.a);
+        SDL_RenderDrawLine(renderer, shm_point.x, shm_point.y, points[0].x, points[0].y);
 
-            SDL_SetRenderDrawColor(renderer, white_color.r, white_color.g, white_color.b, white_color.a);
-            SDL_RenderDrawLine(renderer, SHM_circle.x, SHM_circle.y, shm_point.x, shm_point.y);
+        SDL_SetRenderDrawColor(renderer, white_color.r, white_color.g, white_color.b, white_color.a);
+        SDL_RenderDrawLine(renderer, SHM_circle.x, SHM_circle.y, shm_point.x, shm_point.y);
 
-            if (i<NUM_BODIES-1){
-                SDL_SetRenderDrawColor(renderer, white_color.r, white_color.g, white_color.b, white_color.a);
-                SDL_RenderDrawLine(renderer, points[i].x, points[i].y, points[i+1].x, points[i+1].y);
-            }
-        }
-        
-        // Increase time to progress SHM
-        t += 1;
-        SDL_RenderPresent(renderer);
-        
-        // Render the frame
-        frameEnd = SDL_GetTicks(); 
-        frameTime = frameEnd - frameStart; 
-        fps = 1000.0 / frameTime;
-        printf("FPS: %.2f\n", fps);
+        profile_draw_renderer(renderer);
+        profile_record("rasterize", rasterize_start);
 
-        
+        // Render the frame
+        Uint64 present_start = profile_now();
+        SDL_RenderPresent(renderer);
+        profile_record("present", present_start);
+        profile_frame();
 
         // Delay to control frame rate
         SDL_Delay(1);
     }
+    profile_shutdown();
 
     // Clean up SDL resources
     SDL_DestroyRenderer(renderer);
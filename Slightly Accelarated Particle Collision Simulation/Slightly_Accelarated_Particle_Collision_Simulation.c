@@ -2,6 +2,20 @@
 #include <math.h>
 #include <SDL2/SDL.h>
 #include <stdlib.h>
+#include <string.h>
+#include "../Profiler.h"
+#include "../Random.h"
+#include "../Snapshot.h"
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
 
 #define WIDTH 500
 #define HEIGHT 400
@@ -20,15 +34,154 @@
 #define VELOCITY_X 0.0
 #define VELOCITY_Y 0.0
 #define COEFF_OF_RESTITUTION 0.8
+#define GRID_CELL_SIZE (2 * RADIUS) // A particle can only touch particles in its own or the 8 adjacent cells
+#define INITIAL_CAPACITY 1024
+#define SPAWN_BATCH 256
+#define SNAPSHOT_PATH "particles.snap" // Where S saves the state unless --snapshot says otherwise
+#define SPAN_CACHE_SIZE 8
+#define MAX_RADIUS_CLASS 64 // Sprite mode bakes one disc texture per whole-pixel radius up to this size
+#define PARTICLE_LIFETIME 0 // Physics steps before a particle expires, 0 keeps particles forever
+#define PHYSICS_HZ 240          // Physics steps per second, independent of the render rate
+#define PIXELS_PER_METER 1000.0 // Keeps the old 0.0098 px/frame^2 feel of a 1000 FPS loop
+#define JITTER_SPEED 1000.0     // Collision jitter in px/s, the old +-1 px per 1 ms frame
+#define MAX_FRAME_TIME 0.25     // Longest wall-clock gap simulated at once, so a stall cannot snowball
+#define FRAME_BUDGET (1.0 / 60) // Physics taking longer than this skips the render instead of steps
+#define MAX_SKIPPED_FRAMES 5
+#define MAX_THREADS 64
+#define COLLISION_COLORS 9      // Cells 3 apart in both directions never share a neighbour
+#define CELLS_PER_TASK 8        // Cells a thread claims at a time
+#define PARALLEL_MIN_PARTICLES 2048 // Fewer particles resolve on the main thread alone
+#define DEFAULT_SEED 1
+#define EVENT_CELL_SIZE 32      // Event mode cells, at least one particle diameter
+#define EVENT_TC 2.0            // Steps after a collision during which the next one is elastic
+#define EVENT_MIN_FLIGHT 0.25   // Shortest floor bounce in steps, a resting particle's jiggle
+#define EVENT_HEAP_SLACK 8      // Stale events allowed per particle before the queue is rebuilt
+#define NBODY_THETA 0.5         // Default Barnes-Hut opening angle, --theta overrides it
+#define NBODY_G 250.0           // Gravitational constant of the N-body mode in px^3 / s^2 per unit mass
+#define NBODY_SOFTENING RADIUS  // Keeps the pull of close neighbours finite
+#define NBODY_LEAF_SIZE 8       // Quadtree cells with this many particles or fewer are summed directly
+#define NBODY_KEY_BITS 16       // Morton key bits per axis, the deepest quadtree level
+#define NBODY_TOP_LEVELS 3      // The 4^3 subtrees below these levels are sorted and built in parallel
+#define NBODY_BUCKETS 64
+#define NBODY_TOP_NODES 21      // 1 + 4 + 16 nodes above the buckets
+#define NBODY_CHUNK 256         // Particles a thread claims at a time
+#define NBODY_SIDE (WIDTH > HEIGHT ? WIDTH : HEIGHT)
+
+// Random counters keep the physics step in the high half and what the number is
+// for in the low half: jitter against another particle, or a colour channel
+#define JITTER_COUNTER(step, other, axis) (((Uint64)(step) << 32) | ((Uint64)(other) << 1) | (Uint64)(axis))
+#define COLOR_COUNTER(step, channel) (((Uint64)(step) << 32) | 0x80000000u | (Uint64)(channel))
 
 struct Circle {
-    double m;
     double x;
     double y;
     double r;
-    double velocity_y;
-    double velocity_x;
-    Uint8 red, green , blue, a;
+};
+
+struct Particle_Color {
+    Uint8 red, green, blue, a;
+};
+
+// Structure-of-arrays particle store. The hot x/y/velocity/r arrays are 64-byte
+// aligned so the integration kernel can stream them with full-width vector loads,
+// while colours live in their own array and never enter the physics loops.
+//
+// All arrays are carved out of one arena allocation that doubles when it fills
+// up, so spawning costs one allocation per doubling instead of one per particle.
+// Removed particles are marked dead and their slots go on a free list to be
+// reused by the next spawn; the arrays are never compacted, so indices stay stable.
+struct Particles {
+    int count;       // Slots in use, including dead ones waiting on the free list
+    int alive;
+    int capacity;
+    void *arena;
+    double *m;
+    double *x;
+    double *y;
+    double *r;
+    double *velocity_x;
+    double *velocity_y;
+    double *previous_x;  // Positions before the last physics step, for render interpolation
+    double *previous_y;
+    struct Particle_Color *color;
+    Uint32 *birth_step;
+    Uint8 *dead;
+    int *free_list;
+    int free_count;
+    Uint64 seed;     // Seeds the jitter and colours, see Random.h
+    struct Snapshot *snapshot;  // Holds the arena while it is used in place from a loaded snapshot
+};
+
+// Snapshot chunks. The arena chunk is the arena exactly as particles_carve lays it
+// out, so a loaded snapshot becomes the arena without a copy.
+#define CHUNK_PARTICLE_STATE SNAPSHOT_TAG('P', 'S', 'I', 'M')
+#define CHUNK_PARTICLE_ARENA SNAPSHOT_TAG('P', 'A', 'R', 'N')
+#define PARTICLE_CHUNK_VERSION 1
+
+struct Particle_State {
+    Sint32 count, alive, capacity, free_count;
+    Uint64 seed;
+    Uint32 step;
+    Uint32 reserved;
+};
+
+// Sprite render mode: every particle becomes a textured quad whose vertex colour
+// tints a pre-baked white anti-aliased disc, and all particles of one radius
+// class are drawn with a single SDL_RenderGeometry call.
+struct Sprite_Batch {
+    SDL_Texture *disc[MAX_RADIUS_CLASS + 1];
+    SDL_Vertex *vertices;
+    int *indices;
+    int capacity;
+    int class_count[MAX_RADIUS_CLASS + 1];
+    int class_offset[MAX_RADIUS_CLASS + 1];
+};
+
+typedef void (*integrate_fn)(struct Particles *p, double acceleration, double e);
+
+// Uniform grid rebuilt every step with a counting sort: cell_start[c]..cell_start[c + 1]
+// indexes the particles of cell c inside cell_items.
+//
+// Cells are also split into 9 colors by (x % 3, y % 3). A cell's contacts only touch
+// particles in its 3x3 neighbourhood, and the neighbourhoods of two cells of the same
+// color never overlap, so all cells of one color can be resolved at once.
+// colored_cells[color_start[k]]..colored_cells[color_start[k + 1]] are the cells of color k.
+struct Grid {
+    int cols, rows;
+    int *cell_start;
+    int *cell_items;
+    int *particle_cell;
+    int capacity;
+    int *colored_cells;
+    int color_start[COLLISION_COLORS + 1];
+};
+
+struct Collision_Pool;
+
+struct Collision_Worker {
+    SDL_Thread *thread;
+    SDL_sem *start;
+    struct Collision_Pool *pool;
+};
+
+// Persistent worker threads for the contact solver. For each color the main thread
+// wakes every worker, all threads claim cells of that color until none are left,
+// and the main thread waits for the workers before moving on to the next color.
+// The N-body passes run their jobs on the same threads.
+struct Collision_Pool {
+    int num_threads;            // Including the main thread
+    int quit;
+    SDL_sem *done;
+    struct Collision_Worker workers[MAX_THREADS];
+    void (*job)(struct Collision_Pool *pool);  // What the woken threads run
+    void *job_data;
+
+    struct Grid *grid;
+    struct Particles *particles;
+    double e, jitter;
+    Uint32 step;
+    int color;
+    SDL_atomic_t next_cell;
 };
 
 void draw_grid(SDL_Renderer *renderer) {
@@ -41,125 +194,1606 @@ void draw_grid(SDL_Renderer *renderer) {
     }
 }
 
+// Filled circles are drawn as one horizontal span per row. The spans depend only
+// on the radius, so they are computed once and cached, and a whole circle is
+// submitted with a single SDL_RenderFillRects call instead of one call per pixel.
+struct Circle_Spans {
+    double r;
+    int rows;
+    int *half_width;  // Row y covers x in [-half_width, half_width] (row 0 is y = -r)
+    SDL_Rect *rects;  // Scratch buffer for translating the spans to screen space
+};
+
+struct Circle_Spans *circle_spans(double r) {
+    static struct Circle_Spans cache[SPAN_CACHE_SIZE];
+    static int cached = 0, next_slot = 0;
+
+    for (int i = 0; i < cached; i++) {
+        if (cache[i].r == r) return &cache[i];
+    }
+
+    struct Circle_Spans *spans;
+    if (cached < SPAN_CACHE_SIZE) {
+        spans = &cache[cached++];
+    } else {
+        spans = &cache[next_slot];
+        next_slot = (next_slot + 1) % SPAN_CACHE_SIZE;
+        free(spans->half_width);
+        free(spans->rects);
+    }
+
+    int radius = (int)r;
+    spans->r = r;
+    spans->rows = 2 * radius + 1;
+    spans->half_width = malloc(sizeof(int) * spans->rows);
+    spans->rects = malloc(sizeof(SDL_Rect) * spans->rows);
+    for (int y = -radius; y <= radius; y++) {
+        // Same inclusion test as the per-pixel loop: x * x + y * y <= r * r
+        int w = (int)sqrt(r * r - y * y);
+        while (w < radius && (w + 1) * (w + 1) + y * y <= r * r) w++;
+        while (w > 0 && w * w + y * y > r * r) w--;
+        spans->half_width[y + radius] = w;
+    }
+    return spans;
+}
+
 void draw_circle(SDL_Renderer *renderer, struct Circle circle, Uint8 r, Uint8 g, Uint8 b, Uint8 a) {
+    struct Circle_Spans *spans = circle_spans(circle.r);
+    int radius = (int)circle.r;
+    for (int row = 0; row < spans->rows; row++) {
+        int w = spans->half_width[row];
+        spans->rects[row] = (SDL_Rect){(int)(circle.x - w), (int)(circle.y + row - radius), 2 * w + 1, 1};
+    }
     SDL_SetRenderDrawColor(renderer, r, g, b, a);
-    for (int y = -circle.r; y <= circle.r; y++) {
-        for (int x = -circle.r; x <= circle.r; x++) {
-            if (x * x + y * y <= circle.r * circle.r) {
-                SDL_RenderDrawPoint(renderer, circle.x + x, circle.y + y);
+    SDL_RenderFillRects(renderer, spans->rects, spans->rows);
+}
+
+int radius_class(double r) {
+    int c = (int)ceil(r);
+    if (c < 1) c = 1;
+    if (c > MAX_RADIUS_CLASS) c = MAX_RADIUS_CLASS;
+    return c;
+}
+
+// White disc of the given radius with coverage-based alpha at the edge
+SDL_Texture *bake_disc(SDL_Renderer *renderer, int radius) {
+    int size = 2 * radius + 2;
+    Uint8 *pixels = malloc(4 * size * size);
+    double centre = size / 2.0;
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            double dx = x + 0.5 - centre;
+            double dy = y + 0.5 - centre;
+            double coverage = radius + 0.5 - sqrt(dx * dx + dy * dy);
+            if (coverage < 0) coverage = 0;
+            if (coverage > 1) coverage = 1;
+            Uint8 *px = pixels + 4 * (y * size + x);
+            px[0] = px[1] = px[2] = 255;
+            px[3] = (Uint8)(coverage * 255 + 0.5);
+        }
+    }
+    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, size, size);
+    SDL_UpdateTexture(texture, NULL, pixels, 4 * size);
+    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+    free(pixels);
+    return texture;
+}
+
+void sprite_batch_reserve(struct Sprite_Batch *batch, int capacity) {
+    if (capacity <= batch->capacity) return;
+    int grown = batch->capacity > 0 ? batch->capacity : INITIAL_CAPACITY;
+    while (grown < capacity) grown *= 2;
+
+    batch->vertices = realloc(batch->vertices, sizeof(SDL_Vertex) * 4 * grown);
+    batch->indices = realloc(batch->indices, sizeof(int) * 6 * grown);
+    // Two triangles per quad; the pattern is the same for every sub-range
+    for (int q = 0; q < grown; q++) {
+        int *idx = batch->indices + 6 * q;
+        idx[0] = 4 * q;
+        idx[1] = 4 * q + 1;
+        idx[2] = 4 * q + 2;
+        idx[3] = 4 * q;
+        idx[4] = 4 * q + 2;
+        idx[5] = 4 * q + 3;
+    }
+    batch->capacity = grown;
+}
+
+void draw_particles_batched(SDL_Renderer *renderer, struct Sprite_Batch *batch, struct Particles *p, double alpha) {
+    sprite_batch_reserve(batch, p->alive);
+
+    // Counting sort by radius class so each class is one contiguous vertex range
+    memset(batch->class_count, 0, sizeof(batch->class_count));
+    for (int i = 0; i < p->count; i++) {
+        if (!p->dead[i]) batch->class_count[radius_class(p->r[i])]++;
+    }
+    int offset = 0;
+    for (int c = 0; c <= MAX_RADIUS_CLASS; c++) {
+        batch->class_offset[c] = offset;
+        offset += batch->class_count[c];
+    }
+
+    for (int i = 0; i < p->count; i++) {
+        if (p->dead[i]) continue;
+        int c = radius_class(p->r[i]);
+        SDL_Vertex *v = batch->vertices + 4 * batch->class_offset[c]++;
+        float half = c + 1;
+        float x = (float)(p->previous_x[i] + (p->x[i] - p->previous_x[i]) * alpha);
+        float y = (float)(p->previous_y[i] + (p->y[i] - p->previous_y[i]) * alpha);
+        SDL_Color color = {p->color[i].red, p->color[i].green, p->color[i].blue, p->color[i].a};
+        v[0] = (SDL_Vertex){{x - half, y - half}, color, {0, 0}};
+        v[1] = (SDL_Vertex){{x + half, y - half}, color, {1, 0}};
+        v[2] = (SDL_Vertex){{x + half, y + half}, color, {1, 1}};
+        v[3] = (SDL_Vertex){{x - half, y + half}, color, {0, 1}};
+    }
+
+    offset = 0;
+    for (int c = 0; c <= MAX_RADIUS_CLASS; c++) {
+        int n = batch->class_count[c];
+        if (n == 0) continue;
+        if (batch->disc[c] == NULL) batch->disc[c] = bake_disc(renderer, c);
+        SDL_RenderGeometry(renderer, batch->disc[c], batch->vertices + 4 * offset, 4 * n, batch->indices, 6 * n);
+        offset += n;
+    }
+}
+
+void sprite_batch_free(struct Sprite_Batch *batch) {
+    for (int c = 0; c <= MAX_RADIUS_CLASS; c++) {
+        if (batch->disc[c] != NULL) SDL_DestroyTexture(batch->disc[c]);
+    }
+    free(batch->vertices);
+    free(batch->indices);
+}
+
+size_t arena_align(size_t size) {
+    return (size + 63) & ~(size_t)63;
+}
+
+size_t particles_arena_size(int capacity) {
+    return 8 * arena_align(sizeof(double) * capacity) + arena_align(sizeof(struct Particle_Color) * capacity) +
+           arena_align(sizeof(Uint32) * capacity) + arena_align(sizeof(Uint8) * capacity) +
+           arena_align(sizeof(int) * capacity);
+}
+
+// Points every particle array into arena
+void particles_carve(struct Particles *p, char *arena, int capacity) {
+    size_t doubles = arena_align(sizeof(double) * capacity);
+    size_t colors = arena_align(sizeof(struct Particle_Color) * capacity);
+    size_t steps = arena_align(sizeof(Uint32) * capacity);
+    size_t flags = arena_align(sizeof(Uint8) * capacity);
+    p->arena = arena;
+    p->capacity = capacity;
+    p->m = (double *)arena;
+    p->x = (double *)(arena += doubles);
+    p->y = (double *)(arena += doubles);
+    p->r = (double *)(arena += doubles);
+    p->velocity_x = (double *)(arena += doubles);
+    p->velocity_y = (double *)(arena += doubles);
+    p->previous_x = (double *)(arena += doubles);
+    p->previous_y = (double *)(arena += doubles);
+    p->color = (struct Particle_Color *)(arena += doubles);
+    p->birth_step = (Uint32 *)(arena += colors);
+    p->dead = (Uint8 *)(arena += steps);
+    p->free_list = (int *)(arena += flags);
+}
+
+void particles_release_arena(struct Particles *p) {
+    if (p->snapshot != NULL) {
+        snapshot_close(p->snapshot);
+        p->snapshot = NULL;
+    } else {
+        SDL_SIMDFree(p->arena);
+    }
+}
+
+// Carves every particle array out of one block and copies the old contents over
+int particles_grow(struct Particles *p, int capacity) {
+    char *arena = SDL_SIMDAlloc(particles_arena_size(capacity));
+    if (arena == NULL) return -1;
+
+    struct Particles grown = *p;
+    particles_carve(&grown, arena, capacity);
+    grown.snapshot = NULL;
+
+    if (p->arena != NULL) {
+        memcpy(grown.m, p->m, sizeof(double) * p->count);
+        memcpy(grown.x, p->x, sizeof(double) * p->count);
+        memcpy(grown.y, p->y, sizeof(double) * p->count);
+        memcpy(grown.r, p->r, sizeof(double) * p->count);
+        memcpy(grown.velocity_x, p->velocity_x, sizeof(double) * p->count);
+        memcpy(grown.velocity_y, p->velocity_y, sizeof(double) * p->count);
+        memcpy(grown.previous_x, p->previous_x, sizeof(double) * p->count);
+        memcpy(grown.previous_y, p->previous_y, sizeof(double) * p->count);
+        memcpy(grown.color, p->color, sizeof(struct Particle_Color) * p->count);
+        memcpy(grown.birth_step, p->birth_step, sizeof(Uint32) * p->count);
+        memcpy(grown.dead, p->dead, sizeof(Uint8) * p->count);
+        memcpy(grown.free_list, p->free_list, sizeof(int) * p->free_count);
+        particles_release_arena(p);
+    }
+    *p = grown;
+    return 0;
+}
+
+int particles_reserve(struct Particles *p, int capacity) {
+    if (capacity <= p->capacity) return 0;
+    int grown = p->capacity > 0 ? p->capacity : INITIAL_CAPACITY;
+    while (grown < capacity) grown *= 2;
+    return particles_grow(p, grown);
+}
+
+// Spawns n particles at (x[k], y[k]), reusing freed slots before appending.
+// Returns the number of particles actually spawned.
+int particles_spawn(struct Particles *p, const double *x, const double *y, int n, Uint32 step) {
+    int appended = n - p->free_count;
+    if (appended > 0 && particles_reserve(p, p->count + appended) != 0) {
+        n = p->free_count + (p->capacity - p->count);
+    }
+
+    Random_Batch random_batch = random_uniform_batch_kernel();
+    int ids[SPAWN_BATCH];
+    double channel[SPAWN_BATCH];
+    for (int k = 0; k < n; k++) {
+        int i = p->free_count > 0 ? p->free_list[--p->free_count] : p->count++;
+        ids[k % SPAWN_BATCH] = i;
+        p->x[i] = p->previous_x[i] = x[k];
+        p->y[i] = p->previous_y[i] = y[k];
+        p->r[i] = RADIUS;
+        p->m[i] = 1.0;
+        p->velocity_y[i] = VELOCITY_Y;
+        p->velocity_x[i] = VELOCITY_X;
+        p->color[i].a = 255;
+        p->birth_step[i] = step;
+        p->dead[i] = 0;
+
+        // Colours are drawn for a batch of particles at a time
+        int batch = k % SPAWN_BATCH + 1;
+        if (batch == SPAWN_BATCH || k == n - 1) {
+            random_batch(p->seed, ids, batch, COLOR_COUNTER(step, 0), channel);
+            for (int b = 0; b < batch; b++) p->color[ids[b]].red = (Uint8)(channel[b] * 255);
+            random_batch(p->seed, ids, batch, COLOR_COUNTER(step, 1), channel);
+            for (int b = 0; b < batch; b++) p->color[ids[b]].green = (Uint8)(channel[b] * 255);
+            random_batch(p->seed, ids, batch, COLOR_COUNTER(step, 2), channel);
+            for (int b = 0; b < batch; b++) p->color[ids[b]].blue = (Uint8)(channel[b] * 255);
+        }
+    }
+    p->alive += n;
+    return n;
+}
+
+void particles_remove(struct Particles *p, int i) {
+    if (p->dead[i]) return;
+    p->dead[i] = 1;
+    p->free_list[p->free_count++] = i;
+    p->alive--;
+}
+
+void particles_expire(struct Particles *p, Uint32 step, Uint32 lifetime) {
+    for (int i = 0; i < p->count; i++) {
+        if (!p->dead[i] && step - p->birth_step[i] >= lifetime) {
+            particles_remove(p, i);
+        }
+    }
+}
+
+void particles_free(struct Particles *p) {
+    particles_release_arena(p);
+    memset(p, 0, sizeof(*p));
+}
+
+// Writes the particles, seed and physics step to path. Returns 0 on success.
+int particles_save(const struct Particles *p, Uint32 step, const char *path) {
+    struct Snapshot_Writer writer;
+    if (snapshot_begin(&writer, path) != 0) return -1;
+    struct Particle_State state = {p->count, p->alive, p->capacity, p->free_count, p->seed, step, 0};
+    snapshot_add(&writer, CHUNK_PARTICLE_STATE, PARTICLE_CHUNK_VERSION, &state, sizeof(state));
+    snapshot_add(&writer, CHUNK_PARTICLE_ARENA, PARTICLE_CHUNK_VERSION, p->arena, particles_arena_size(p->capacity));
+    return snapshot_end(&writer);
+}
+
+// Replaces the particles with the ones saved in snapshot, using its arena in place.
+// The snapshot stays open until the arena grows or is freed. Returns 0 on success.
+int particles_load(struct Particles *p, struct Snapshot *snapshot, Uint32 *step) {
+    size_t state_size = 0, arena_size = 0;
+    const struct Particle_State *state =
+        snapshot_chunk(snapshot, CHUNK_PARTICLE_STATE, PARTICLE_CHUNK_VERSION, &state_size);
+    char *arena = snapshot_chunk(snapshot, CHUNK_PARTICLE_ARENA, PARTICLE_CHUNK_VERSION, &arena_size);
+    if (state == NULL || arena == NULL || state_size != sizeof(*state)) return -1;
+    if (state->capacity <= 0 || arena_size != particles_arena_size(state->capacity) ||
+        state->count < 0 || state->count > state->capacity ||
+        state->free_count < 0 || state->free_count > state->count ||
+        state->alive != state->count - state->free_count) {
+        return -1;
+    }
+
+    particles_free(p);
+    particles_carve(p, arena, state->capacity);
+    p->count = state->count;
+    p->alive = state->alive;
+    p->free_count = state->free_count;
+    p->seed = state->seed;
+    p->snapshot = snapshot;
+    *step = state->step;
+    return 0;
+}
+
+// FNV-1a over the physical state, to check that a replay matches the original run
+Uint64 particles_hash(const struct Particles *p) {
+    const double *arrays[] = {p->x, p->y, p->velocity_x, p->velocity_y};
+    Uint64 hash = 0xCBF29CE484222325ull;
+    for (int a = 0; a < 4; a++) {
+        const Uint8 *bytes = (const Uint8 *)arrays[a];
+        for (size_t k = 0; k < sizeof(double) * p->count; k++) {
+            hash = (hash ^ bytes[k]) * 0x100000001B3ull;
+        }
+    }
+    return hash;
+}
+
+// Spawns the logged mouse samples up to step in the order they were recorded.
+// Returns 1 once the log has reached the step the recorded run ended at.
+int replay_spawn(struct Input_Replay *replay, struct Particles *p, Uint32 step) {
+    double x[SPAWN_BATCH], y[SPAWN_BATCH];
+    int n = 0, ended = 0;
+    struct Input_Event event;
+    while (input_replay_next(replay, step, &event)) {
+        if (event.type == INPUT_END) ended = 1;
+        if (event.type != INPUT_POINTER) continue;
+        if (n == SPAWN_BATCH) {
+            particles_spawn(p, x, y, n, step);
+            n = 0;
+        }
+        x[n] = event.a;
+        y[n] = event.b;
+        n++;
+    }
+    if (n > 0) particles_spawn(p, x, y, n, step);
+    return ended || !replay->has_next;
+}
+
+// Gravity, Euler step and wall bounce for particles [first, last)
+void integrate_range(struct Particles *p, int first, int last, double acceleration, double e) {
+    for (int i = first; i < last; i++) {
+        p->velocity_y[i] += acceleration;
+        p->y[i] += p->velocity_y[i];
+        p->x[i] += p->velocity_x[i];
+
+        if (p->x[i] + p->r[i] > WIDTH) {
+            p->x[i] = WIDTH - p->r[i];
+            p->velocity_x[i] = -p->velocity_x[i] * e;
+        }
+        if (p->x[i] - p->r[i] < 0) {
+            p->x[i] = 0 + p->r[i];
+            p->velocity_x[i] = -p->velocity_x[i] * e;
+        }
+        if (p->y[i] + p->r[i] > HEIGHT) {
+            p->y[i] = HEIGHT - p->r[i];
+            p->velocity_y[i] = -p->velocity_y[i] * e;
+        }
+        if (p->y[i] - p->r[i] < 0) {
+            p->y[i] = 0 + p->r[i];
+            p->velocity_y[i] = -p->velocity_y[i] * e;
+        }
+    }
+}
+
+void integrate_scalar(struct Particles *p, double acceleration, double e) {
+    integrate_range(p, 0, p->count, acceleration, e);
+}
+
+#ifdef HAVE_X86_SIMD
+// The vector kernels evaluate the same comparisons in the same order as
+// integrate_range and select the clamped values with masks, so every lane
+// ends up bit-identical to the scalar result.
+void integrate_sse2(struct Particles *p, double acceleration, double e) {
+    __m128d acc = _mm_set1_pd(acceleration);
+    __m128d restitution = _mm_set1_pd(e);
+    __m128d width = _mm_set1_pd(WIDTH);
+    __m128d height = _mm_set1_pd(HEIGHT);
+    __m128d zero = _mm_setzero_pd();
+    __m128d sign = _mm_set1_pd(-0.0);
+    int i = 0;
+    for (; i + 2 <= p->count; i += 2) {
+        __m128d x = _mm_load_pd(p->x + i);
+        __m128d y = _mm_load_pd(p->y + i);
+        __m128d r = _mm_load_pd(p->r + i);
+        __m128d vx = _mm_load_pd(p->velocity_x + i);
+        __m128d vy = _mm_add_pd(_mm_load_pd(p->velocity_y + i), acc);
+        y = _mm_add_pd(y, vy);
+        x = _mm_add_pd(x, vx);
+
+        __m128d hit = _mm_cmpgt_pd(_mm_add_pd(x, r), width);
+        x = _mm_or_pd(_mm_and_pd(hit, _mm_sub_pd(width, r)), _mm_andnot_pd(hit, x));
+        vx = _mm_or_pd(_mm_and_pd(hit, _mm_mul_pd(_mm_xor_pd(vx, sign), restitution)), _mm_andnot_pd(hit, vx));
+        hit = _mm_cmplt_pd(_mm_sub_pd(x, r), zero);
+        x = _mm_or_pd(_mm_and_pd(hit, _mm_add_pd(zero, r)), _mm_andnot_pd(hit, x));
+        vx = _mm_or_pd(_mm_and_pd(hit, _mm_mul_pd(_mm_xor_pd(vx, sign), restitution)), _mm_andnot_pd(hit, vx));
+        hit = _mm_cmpgt_pd(_mm_add_pd(y, r), height);
+        y = _mm_or_pd(_mm_and_pd(hit, _mm_sub_pd(height, r)), _mm_andnot_pd(hit, y));
+        vy = _mm_or_pd(_mm_and_pd(hit, _mm_mul_pd(_mm_xor_pd(vy, sign), restitution)), _mm_andnot_pd(hit, vy));
+        hit = _mm_cmplt_pd(_mm_sub_pd(y, r), zero);
+        y = _mm_or_pd(_mm_and_pd(hit, _mm_add_pd(zero, r)), _mm_andnot_pd(hit, y));
+        vy = _mm_or_pd(_mm_and_pd(hit, _mm_mul_pd(_mm_xor_pd(vy, sign), restitution)), _mm_andnot_pd(hit, vy));
+
+        _mm_store_pd(p->x + i, x);
+        _mm_store_pd(p->y + i, y);
+        _mm_store_pd(p->velocity_x + i, vx);
+        _mm_store_pd(p->velocity_y + i, vy);
+    }
+    integrate_range(p, i, p->count, acceleration, e);
+}
+
+TARGET_AVX2 void integrate_avx2(struct Particles *p, double acceleration, double e) {
+    __m256d acc = _mm256_set1_pd(acceleration);
+    __m256d restitution = _mm256_set1_pd(e);
+    __m256d width = _mm256_set1_pd(WIDTH);
+    __m256d height = _mm256_set1_pd(HEIGHT);
+    __m256d zero = _mm256_setzero_pd();
+    __m256d sign = _mm256_set1_pd(-0.0);
+    int i = 0;
+    for (; i + 4 <= p->count; i += 4) {
+        __m256d x = _mm256_load_pd(p->x + i);
+        __m256d y = _mm256_load_pd(p->y + i);
+        __m256d r = _mm256_load_pd(p->r + i);
+        __m256d vx = _mm256_load_pd(p->velocity_x + i);
+        __m256d vy = _mm256_add_pd(_mm256_load_pd(p->velocity_y + i), acc);
+        y = _mm256_add_pd(y, vy);
+        x = _mm256_add_pd(x, vx);
+
+        __m256d hit = _mm256_cmp_pd(_mm256_add_pd(x, r), width, _CMP_GT_OQ);
+        x = _mm256_blendv_pd(x, _mm256_sub_pd(width, r), hit);
+        vx = _mm256_blendv_pd(vx, _mm256_mul_pd(_mm256_xor_pd(vx, sign), restitution), hit);
+        hit = _mm256_cmp_pd(_mm256_sub_pd(x, r), zero, _CMP_LT_OQ);
+        x = _mm256_blendv_pd(x, _mm256_add_pd(zero, r), hit);
+        vx = _mm256_blendv_pd(vx, _mm256_mul_pd(_mm256_xor_pd(vx, sign), restitution), hit);
+        hit = _mm256_cmp_pd(_mm256_add_pd(y, r), height, _CMP_GT_OQ);
+        y = _mm256_blendv_pd(y, _mm256_sub_pd(height, r), hit);
+        vy = _mm256_blendv_pd(vy, _mm256_mul_pd(_mm256_xor_pd(vy, sign), restitution), hit);
+        hit = _mm256_cmp_pd(_mm256_sub_pd(y, r), zero, _CMP_LT_OQ);
+        y = _mm256_blendv_pd(y, _mm256_add_pd(zero, r), hit);
+        vy = _mm256_blendv_pd(vy, _mm256_mul_pd(_mm256_xor_pd(vy, sign), restitution), hit);
+
+        _mm256_store_pd(p->x + i, x);
+        _mm256_store_pd(p->y + i, y);
+        _mm256_store_pd(p->velocity_x + i, vx);
+        _mm256_store_pd(p->velocity_y + i, vy);
+    }
+    integrate_range(p, i, p->count, acceleration, e);
+}
+#endif
+
+integrate_fn select_integrator(void) {
+#ifdef HAVE_X86_SIMD
+    if (SDL_HasAVX2()) return integrate_avx2;
+    if (SDL_HasSSE2()) return integrate_sse2;
+#endif
+    return integrate_scalar;
+}
+
+void grid_init(struct Grid *grid) {
+    grid->cols = (WIDTH + GRID_CELL_SIZE - 1) / GRID_CELL_SIZE;
+    grid->rows = (HEIGHT + GRID_CELL_SIZE - 1) / GRID_CELL_SIZE;
+    grid->cell_start = calloc(grid->cols * grid->rows + 1, sizeof(int));
+    grid->cell_items = NULL;
+    grid->particle_cell = NULL;
+    grid->capacity = 0;
+
+    grid->colored_cells = malloc(sizeof(int) * grid->cols * grid->rows);
+    int n = 0;
+    for (int k = 0; k < COLLISION_COLORS; k++) {
+        grid->color_start[k] = n;
+        for (int cy = k / 3; cy < grid->rows; cy += 3) {
+            for (int cx = k % 3; cx < grid->cols; cx += 3) {
+                grid->colored_cells[n++] = cy * grid->cols + cx;
+            }
+        }
+    }
+    grid->color_start[COLLISION_COLORS] = n;
+}
+
+int grid_cell_of(struct Grid *grid, double x, double y) {
+    int cx = (int)(x / GRID_CELL_SIZE);
+    int cy = (int)(y / GRID_CELL_SIZE);
+    if (cx < 0) cx = 0;
+    if (cx >= grid->cols) cx = grid->cols - 1;
+    if (cy < 0) cy = 0;
+    if (cy >= grid->rows) cy = grid->rows - 1;
+    return cy * grid->cols + cx;
+}
+
+void grid_build(struct Grid *grid, struct Particles *p) {
+    int count = p->count;
+    int num_cells = grid->cols * grid->rows;
+    if (count > grid->capacity) {
+        grid->capacity = count * 2;
+        grid->cell_items = realloc(grid->cell_items, sizeof(int) * grid->capacity);
+        grid->particle_cell = realloc(grid->particle_cell, sizeof(int) * grid->capacity);
+    }
+
+    memset(grid->cell_start, 0, sizeof(int) * (num_cells + 1));
+    for (int i = 0; i < count; i++) {
+        if (p->dead[i]) {
+            grid->particle_cell[i] = -1;
+            continue;
+        }
+        grid->particle_cell[i] = grid_cell_of(grid, p->x[i], p->y[i]);
+        grid->cell_start[grid->particle_cell[i]]++;
+    }
+    for (int c = 1; c < num_cells; c++) {
+        grid->cell_start[c] += grid->cell_start[c - 1];
+    }
+    grid->cell_start[num_cells] = grid->cell_start[num_cells - 1];
+    // Scatter in reverse so each cell keeps its particles in ascending index order
+    for (int i = count - 1; i >= 0; i--) {
+        if (grid->particle_cell[i] < 0) continue;
+        grid->cell_items[--grid->cell_start[grid->particle_cell[i]]] = i;
+    }
+}
+
+void grid_free(struct Grid *grid) {
+    free(grid->cell_start);
+    free(grid->cell_items);
+    free(grid->particle_cell);
+    free(grid->colored_cells);
+}
+
+void resolve_collision(struct Particles *p, int i, int j, double e, double jitter, Uint32 step) {
+    double dx = p->x[i] - p->x[j];
+    double dy = p->y[i] - p->y[j];
+    double distance = sqrt(dx * dx + dy * dy);
+    if (distance >= p->r[i] + p->r[j] || distance == 0) return;
+
+    double angle = atan2(dy, dx);
+    double overlap = (p->r[i] + p->r[j]) - distance;
+
+    p->x[i] += cos(angle) * overlap / 2;
+    p->y[i] += sin(angle) * overlap / 2;
+    p->x[j] -= cos(angle) * overlap / 2;
+    p->y[j] -= sin(angle) * overlap / 2;
+
+    double nx = dx / distance;
+    double ny = dy / distance;
+    double vix = p->velocity_x[i];
+    double viy = p->velocity_y[i];
+    double vjx = p->velocity_x[j];
+    double vjy = p->velocity_y[j];
+
+    double vi = vix * nx + viy * ny;
+    double vj = vjx * nx + vjy * ny;
+
+    double vi_new = vj + e * (vi - vj);
+    double vj_new = vi + e * (vj - vi);
+
+    // Each particle's jitter is keyed by its own id, the step and the other particle,
+    // so it does not depend on which thread resolves the contact or when
+    Uint64 key_i = random_key(p->seed, i), key_j = random_key(p->seed, j);
+    p->velocity_x[i] += jitter * random_signed_keyed(key_i, JITTER_COUNTER(step, j, 0)) + (vi_new - vi) * nx;
+    p->velocity_y[i] += jitter * random_signed_keyed(key_i, JITTER_COUNTER(step, j, 1)) + (vi_new - vi) * ny;
+    p->velocity_x[j] += jitter * random_signed_keyed(key_j, JITTER_COUNTER(step, i, 0)) + (vj_new - vj) * nx;
+    p->velocity_y[j] += jitter * random_signed_keyed(key_j, JITTER_COUNTER(step, i, 1)) + (vj_new - vj) * ny;
+}
+
+// Broad phase: only particles in the same or adjacent cells can overlap, and each
+// pair is visited once by only pairing a particle with higher-indexed neighbours.
+// The pair belongs to the cell of its lower-indexed particle.
+void collide_cell(struct Grid *grid, struct Particles *p, int cell, double e, double jitter, Uint32 step) {
+    int cx = cell % grid->cols;
+    int cy = cell / grid->cols;
+    for (int a = grid->cell_start[cell]; a < grid->cell_start[cell + 1]; a++) {
+        int i = grid->cell_items[a];
+        for (int ny = cy - 1; ny <= cy + 1; ny++) {
+            if (ny < 0 || ny >= grid->rows) continue;
+            for (int nx = cx - 1; nx <= cx + 1; nx++) {
+                if (nx < 0 || nx >= grid->cols) continue;
+                int c = ny * grid->cols + nx;
+                for (int k = grid->cell_start[c]; k < grid->cell_start[c + 1]; k++) {
+                    int j = grid->cell_items[k];
+                    if (j > i) {
+                        resolve_collision(p, i, j, e, jitter, step);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Claims cells of the pool's current color until there are none left
+void collide_color(struct Collision_Pool *pool) {
+    PROFILE_SCOPE("contacts");
+    struct Grid *grid = pool->grid;
+    int first = grid->color_start[pool->color];
+    int count = grid->color_start[pool->color + 1] - first;
+    while (1) {
+        int task = SDL_AtomicAdd(&pool->next_cell, CELLS_PER_TASK);
+        if (task >= count) break;
+        int last = task + CELLS_PER_TASK < count ? task + CELLS_PER_TASK : count;
+        for (int k = task; k < last; k++) {
+            collide_cell(grid, pool->particles, grid->colored_cells[first + k], pool->e, pool->jitter, pool->step);
+        }
+    }
+}
+
+int collision_worker(void *data) {
+    struct Collision_Worker *worker = (struct Collision_Worker *)data;
+    struct Collision_Pool *pool = worker->pool;
+    while (1) {
+        SDL_SemWait(worker->start);
+        if (pool->quit) break;
+        pool->job(pool);
+        SDL_SemPost(pool->done);
+    }
+    return 0;
+}
+
+// Returns 0 on success. A pool of one thread runs everything on the caller.
+int collision_pool_create(struct Collision_Pool *pool, int num_threads) {
+    memset(pool, 0, sizeof(*pool));
+    if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+    pool->num_threads = 1;
+    pool->done = SDL_CreateSemaphore(0);
+    if (pool->done == NULL) return -1;
+    for (int t = 1; t < num_threads; t++) {
+        struct Collision_Worker *worker = &pool->workers[t];
+        worker->pool = pool;
+        worker->start = SDL_CreateSemaphore(0);
+        if (worker->start == NULL) return -1;
+        worker->thread = SDL_CreateThread(collision_worker, "CollisionWorker", worker);
+        if (worker->thread == NULL) {
+            SDL_DestroySemaphore(worker->start);
+            return -1;
+        }
+        pool->num_threads++;
+    }
+    return 0;
+}
+
+void collision_pool_destroy(struct Collision_Pool *pool) {
+    pool->quit = 1;
+    for (int t = 1; t < pool->num_threads; t++) {
+        SDL_SemPost(pool->workers[t].start);
+        SDL_WaitThread(pool->workers[t].thread, NULL);
+        SDL_DestroySemaphore(pool->workers[t].start);
+    }
+    if (pool->done) SDL_DestroySemaphore(pool->done);
+}
+
+// Runs job on the caller and the first helpers workers, and returns once all are done
+void pool_run(struct Collision_Pool *pool, void (*job)(struct Collision_Pool *pool), void *data, int helpers) {
+    if (helpers > pool->num_threads - 1) helpers = pool->num_threads - 1;
+    pool->job = job;
+    pool->job_data = data;
+    for (int t = 1; t <= helpers; t++) SDL_SemPost(pool->workers[t].start);
+    job(pool);
+    for (int t = 1; t <= helpers; t++) SDL_SemWait(pool->done);
+}
+
+// Resolves every contact color by color. Cells of one color never touch the same
+// particle, so the result is the same for any number of threads.
+void collide_particles(struct Grid *grid, struct Collision_Pool *pool, struct Particles *p,
+                       double e, double jitter, Uint32 step) {
+    PROFILE_SCOPE("collide");
+    grid_build(grid, p);
+
+    int helpers = p->alive >= PARALLEL_MIN_PARTICLES ? pool->num_threads - 1 : 0;
+    pool->grid = grid;
+    pool->particles = p;
+    pool->e = e;
+    pool->jitter = jitter;
+    pool->step = step;
+    for (int k = 0; k < COLLISION_COLORS; k++) {
+        pool->color = k;
+        SDL_AtomicSet(&pool->next_cell, 0);
+        pool_run(pool, collide_color, NULL, helpers);
+    }
+}
+
+// Event-driven mode. Every particle flies on an exact parabola between collisions,
+// and since all of them fall with the same gravity, two particles approach along a
+// straight line. The time of impact of a pair is therefore a quadratic in t, as is
+// the time a particle reaches the floor, ceiling or the next cell boundary. Those
+// candidate events sit in a min-heap ordered by time. The simulation jumps straight
+// from one event to the next and only moves the particles the event involves.
+//
+// Each particle's state (x, y, velocity) refers to its own time[i]. Every change
+// of trajectory or cell bumps count[i], and queued events remember the counts they
+// were predicted with, so stale events are simply skipped when they come up.
+//
+// Inelastic collisions between particles at rest would otherwise come infinitely
+// fast (inelastic collapse). A collision within EVENT_TC steps of a particle's
+// previous one is therefore elastic.
+enum {
+    EVENT_WALL_LEFT = -1,
+    EVENT_WALL_RIGHT = -2,
+    EVENT_FLOOR = -3,
+    EVENT_CEILING = -4,
+    EVENT_CELL = -5             // j = EVENT_CELL - c moves particle i into cell c
+};
+
+struct Event {
+    double time;
+    int i, j;                   // j >= 0 is another particle, negative j one of the above
+    Uint32 count_i, count_j;
+};
+
+struct Event_World {
+    double now;                 // In physics steps
+    double gravity;             // px per step^2
+    double e;
+    int cols, rows;
+    int *cell_head;             // First particle of every cell
+    int capacity;
+    int *cell, *next, *prev;    // Cell of every particle, -1 when untracked, and its list links
+    double *time;
+    double *last_collision;
+    Uint32 *count;
+    struct Event *heap;
+    int heap_size, heap_capacity;
+    long processed;
+};
+
+void event_world_init(struct Event_World *w, double gravity, double e) {
+    memset(w, 0, sizeof(*w));
+    w->gravity = gravity;
+    w->e = e;
+    w->cols = (WIDTH + EVENT_CELL_SIZE - 1) / EVENT_CELL_SIZE;
+    w->rows = (HEIGHT + EVENT_CELL_SIZE - 1) / EVENT_CELL_SIZE;
+    w->cell_head = malloc(sizeof(int) * w->cols * w->rows);
+    for (int c = 0; c < w->cols * w->rows; c++) w->cell_head[c] = -1;
+}
+
+void event_world_free(struct Event_World *w) {
+    free(w->cell_head);
+    free(w->cell);
+    free(w->next);
+    free(w->prev);
+    free(w->time);
+    free(w->last_collision);
+    free(w->count);
+    free(w->heap);
+}
+
+int event_world_reserve(struct Event_World *w, int capacity) {
+    if (capacity <= w->capacity) return 0;
+    int *cell = realloc(w->cell, sizeof(int) * capacity);
+    if (cell) w->cell = cell;
+    int *next = realloc(w->next, sizeof(int) * capacity);
+    if (next) w->next = next;
+    int *prev = realloc(w->prev, sizeof(int) * capacity);
+    if (prev) w->prev = prev;
+    double *time = realloc(w->time, sizeof(double) * capacity);
+    if (time) w->time = time;
+    double *last = realloc(w->last_collision, sizeof(double) * capacity);
+    if (last) w->last_collision = last;
+    Uint32 *count = realloc(w->count, sizeof(Uint32) * capacity);
+    if (count) w->count = count;
+    if (!cell || !next || !prev || !time || !last || !count) return -1;
+    for (int i = w->capacity; i < capacity; i++) {
+        w->cell[i] = -1;
+        w->count[i] = 0;
+    }
+    w->capacity = capacity;
+    return 0;
+}
+
+void event_push(struct Event_World *w, struct Event event) {
+    if (w->heap_size == w->heap_capacity) {
+        int capacity = w->heap_capacity ? w->heap_capacity * 2 : 1024;
+        struct Event *heap = realloc(w->heap, sizeof(struct Event) * capacity);
+        if (heap == NULL) return;
+        w->heap = heap;
+        w->heap_capacity = capacity;
+    }
+    int k = w->heap_size++;
+    while (k > 0 && w->heap[(k - 1) / 2].time > event.time) {
+        w->heap[k] = w->heap[(k - 1) / 2];
+        k = (k - 1) / 2;
+    }
+    w->heap[k] = event;
+}
+
+struct Event event_pop(struct Event_World *w) {
+    struct Event top = w->heap[0];
+    struct Event last = w->heap[--w->heap_size];
+    int k = 0;
+    while (2 * k + 1 < w->heap_size) {
+        int child = 2 * k + 1;
+        if (child + 1 < w->heap_size && w->heap[child + 1].time < w->heap[child].time) child++;
+        if (w->heap[child].time >= last.time) break;
+        w->heap[k] = w->heap[child];
+        k = child;
+    }
+    w->heap[k] = last;
+    return top;
+}
+
+// Moves particle i along its parabola to time t
+void event_advance(struct Event_World *w, struct Particles *p, int i, double t) {
+    double dt = t - w->time[i];
+    p->x[i] += p->velocity_x[i] * dt;
+    p->y[i] += p->velocity_y[i] * dt + 0.5 * w->gravity * dt * dt;
+    p->velocity_y[i] += w->gravity * dt;
+    w->time[i] = t;
+}
+
+void event_link(struct Event_World *w, int i, int c) {
+    w->cell[i] = c;
+    w->prev[i] = -1;
+    w->next[i] = w->cell_head[c];
+    if (w->cell_head[c] >= 0) w->prev[w->cell_head[c]] = i;
+    w->cell_head[c] = i;
+}
+
+void event_unlink(struct Event_World *w, int i) {
+    int c = w->cell[i];
+    if (w->prev[i] >= 0) w->next[w->prev[i]] = w->next[i];
+    else w->cell_head[c] = w->next[i];
+    if (w->next[i] >= 0) w->prev[w->next[i]] = w->prev[i];
+    w->cell[i] = -1;
+}
+
+// Time until a coordinate moving at v reaches distance d ahead of it, or INFINITY
+double event_line_time(double v, double d) {
+    if (v <= 0) return INFINITY;
+    return d > 0 ? d / v : 0;
+}
+
+// Time until y + v t + g t^2 / 2 reaches y + d, d ahead in the direction gravity
+// pulls, or INFINITY. Rounding can leave d slightly negative right after a crossing.
+double event_fall_time(double v, double g, double d) {
+    if (d < 0) d = 0;
+    if (g <= 0) return event_line_time(v, d);
+    // Positive root of g t^2 / 2 + v t - d = 0, written so it cannot cancel
+    double disc = v * v + 2 * g * d;
+    return v > 0 ? 2 * d / (v + sqrt(disc)) : (-v + sqrt(disc)) / g;
+}
+
+// Time until y + v t + g t^2 / 2 climbs to y - d against gravity, or INFINITY
+double event_rise_time(double v, double g, double d) {
+    if (v >= 0) return INFINITY;
+    if (d <= 0) return 0;
+    double disc = v * v - 2 * g * d;
+    if (disc < 0) return INFINITY;              // Turns back before reaching it
+    return 2 * d / (-v + sqrt(disc));
+}
+
+// Pushes every event particle i can take part in next: walls, its cell boundary and
+// every approaching neighbour
+void event_predict(struct Event_World *w, struct Particles *p, int i) {
+    double now = w->now, g = w->gravity;
+    double dt = now - w->time[i];
+    double x = p->x[i] + p->velocity_x[i] * dt;
+    double y = p->y[i] + p->velocity_y[i] * dt + 0.5 * g * dt * dt;
+    double vx = p->velocity_x[i];
+    double vy = p->velocity_y[i] + g * dt;
+    double r = p->r[i];
+    struct Event event = {0, i, 0, w->count[i], 0};
+
+    // Walls
+    double t_left = event_line_time(-vx, x - r);
+    double t_right = event_line_time(vx, WIDTH - r - x);
+    double t_floor = event_fall_time(vy, g, HEIGHT - r - y);
+    double t_ceiling = event_rise_time(vy, g, y - r);
+    event.j = EVENT_WALL_LEFT;
+    event.time = t_left;
+    if (t_right < event.time) { event.j = EVENT_WALL_RIGHT; event.time = t_right; }
+    if (t_floor < event.time) { event.j = EVENT_FLOOR; event.time = t_floor; }
+    if (t_ceiling < event.time) { event.j = EVENT_CEILING; event.time = t_ceiling; }
+    double t_wall = event.time;
+    if (t_wall < INFINITY) {
+        event.time = now + t_wall;
+        event_push(w, event);
+    }
+
+    // Leaving the cell, when that comes before the wall
+    int c = w->cell[i];
+    int cx = c % w->cols, cy = c / w->cols;
+    double t_cell = INFINITY;
+    int target = c;
+    double t = event_line_time(vx, (cx + 1) * EVENT_CELL_SIZE - x);
+    if (t < t_cell && cx + 1 < w->cols) { t_cell = t; target = c + 1; }
+    t = event_line_time(-vx, x - cx * EVENT_CELL_SIZE);
+    if (t < t_cell && cx > 0) { t_cell = t; target = c - 1; }
+    t = event_fall_time(vy, g, (cy + 1) * EVENT_CELL_SIZE - y);
+    if (t < t_cell && cy + 1 < w->rows) { t_cell = t; target = c + w->cols; }
+    t = event_rise_time(vy, g, y - cy * EVENT_CELL_SIZE);
+    if (t < t_cell && cy > 0) { t_cell = t; target = c - w->cols; }
+    if (t_cell < t_wall) {
+        event.j = EVENT_CELL - target;
+        event.time = now + t_cell;
+        event_push(w, event);
+    }
+
+    // Neighbours share gravity, so relative motion is a straight line
+    for (int ny = cy - 1; ny <= cy + 1; ny++) {
+        if (ny < 0 || ny >= w->rows) continue;
+        for (int nx = cx - 1; nx <= cx + 1; nx++) {
+            if (nx < 0 || nx >= w->cols) continue;
+            for (int j = w->cell_head[ny * w->cols + nx]; j >= 0; j = w->next[j]) {
+                if (j == i) continue;
+                double dtj = now - w->time[j];
+                double dx = x - (p->x[j] + p->velocity_x[j] * dtj);
+                double dy = y - (p->y[j] + p->velocity_y[j] * dtj + 0.5 * g * dtj * dtj);
+                double dvx = vx - p->velocity_x[j];
+                double dvy = vy - (p->velocity_y[j] + g * dtj);
+                double b = dx * dvx + dy * dvy;
+                if (b >= 0) continue;               // Moving apart
+                double a = dvx * dvx + dvy * dvy;
+                double reach = r + p->r[j];
+                double cc = dx * dx + dy * dy - reach * reach;
+                double disc = b * b - a * cc;
+                if (disc < 0) continue;             // Passing by
+                event.j = j;
+                event.count_j = w->count[j];
+                event.time = now + (cc <= 0 ? 0 : cc / (-b + sqrt(disc)));
+                event_push(w, event);
+            }
+        }
+    }
+}
+
+// Starts tracking particles spawned since the last call and drops dead ones
+void event_track(struct Event_World *w, struct Particles *p) {
+    if (event_world_reserve(w, p->capacity) != 0) return;
+    for (int i = 0; i < p->count; i++) {
+        if (p->dead[i] && w->cell[i] >= 0) {
+            event_unlink(w, i);
+            w->count[i]++;
+        } else if (!p->dead[i] && w->cell[i] < 0) {
+            int cx = (int)(p->x[i] / EVENT_CELL_SIZE), cy = (int)(p->y[i] / EVENT_CELL_SIZE);
+            cx = cx < 0 ? 0 : cx >= w->cols ? w->cols - 1 : cx;
+            cy = cy < 0 ? 0 : cy >= w->rows ? w->rows - 1 : cy;
+            event_link(w, i, cy * w->cols + cx);
+            w->time[i] = w->now;
+            w->last_collision[i] = -INFINITY;
+            w->count[i]++;
+            event_predict(w, p, i);
+        }
+    }
+}
+
+double event_restitution(struct Event_World *w, int i) {
+    return w->now - w->last_collision[i] < EVENT_TC ? 1.0 : w->e;
+}
+
+// Processes every event up to time until, then brings all particles to that time
+void event_run(struct Event_World *w, struct Particles *p, double until) {
+    // Stale events pile up in dense scenes, so the queue is rebuilt from scratch now and then
+    if (w->heap_size > EVENT_HEAP_SLACK * p->alive + 1024) {
+        w->heap_size = 0;
+        for (int i = 0; i < p->count; i++) {
+            if (w->cell[i] >= 0) event_predict(w, p, i);
+        }
+    }
+
+    while (w->heap_size > 0 && w->heap[0].time <= until) {
+        struct Event event = event_pop(w);
+        int i = event.i, j = event.j;
+        if (event.count_i != w->count[i] || w->cell[i] < 0) continue;
+        if (j >= 0 && (event.count_j != w->count[j] || w->cell[j] < 0)) continue;
+        w->now = event.time;
+        w->processed++;
+        event_advance(w, p, i, w->now);
+
+        if (j >= 0) {
+            event_advance(w, p, j, w->now);
+            double dx = p->x[i] - p->x[j], dy = p->y[i] - p->y[j];
+            double distance = sqrt(dx * dx + dy * dy);
+            if (distance > 0) {
+                double nx = dx / distance, ny = dy / distance;
+                double approach = (p->velocity_x[i] - p->velocity_x[j]) * nx +
+                                  (p->velocity_y[i] - p->velocity_y[j]) * ny;
+                if (approach < 0) {
+                    double e = fmax(event_restitution(w, i), event_restitution(w, j));
+                    double impulse = -(1 + e) * approach / (1 / p->m[i] + 1 / p->m[j]);
+                    p->velocity_x[i] += impulse / p->m[i] * nx;
+                    p->velocity_y[i] += impulse / p->m[i] * ny;
+                    p->velocity_x[j] -= impulse / p->m[j] * nx;
+                    p->velocity_y[j] -= impulse / p->m[j] * ny;
+                }
+            }
+            w->last_collision[i] = w->last_collision[j] = w->now;
+            w->count[i]++;
+            w->count[j]++;
+            event_predict(w, p, i);
+            event_predict(w, p, j);
+            continue;
+        }
+
+        if (j <= EVENT_CELL) {
+            event_unlink(w, i);
+            event_link(w, i, EVENT_CELL - j);
+        } else {
+            double e = event_restitution(w, i);
+            double r = p->r[i];
+            if (j == EVENT_WALL_LEFT || j == EVENT_WALL_RIGHT) {
+                p->x[i] = j == EVENT_WALL_LEFT ? r : WIDTH - r;
+                p->velocity_x[i] = -p->velocity_x[i] * e;
+            } else if (j == EVENT_CEILING) {
+                p->y[i] = r;
+                p->velocity_y[i] = -p->velocity_y[i] * e;
+            } else {
+                // A particle settling on the floor would bounce ever faster. Every
+                // bounce lasts at least EVENT_MIN_FLIGHT steps instead.
+                double min_bounce = w->gravity * EVENT_MIN_FLIGHT / 2;
+                p->y[i] = HEIGHT - r;
+                p->velocity_y[i] = fmin(-p->velocity_y[i] * e, -min_bounce);
+            }
+            w->last_collision[i] = w->now;
+        }
+        w->count[i]++;
+        event_predict(w, p, i);
+    }
+
+    w->now = until;
+    for (int i = 0; i < p->count; i++) {
+        if (w->cell[i] >= 0) event_advance(w, p, i, until);
+    }
+}
+
+// N-body mode. Instead of the uniform pull toward the floor, every particle attracts
+// every other with G m_i m_j / (d^2 + eps^2). The sum is approximated with a
+// Barnes-Hut quadtree: a cell far enough away, side / distance < theta, acts as a
+// single body at its centre of mass, which brings one step down to O(n log n).
+//
+// The tree is rebuilt each step from particles sorted by Morton key, so every cell is
+// a contiguous range of the sorted arrays. The top 3 levels split the square into
+// 64 buckets. Threads sort and build the buckets independently: once to count their
+// nodes, and again after a prefix sum to write them to their place. Only the 21
+// nodes above the buckets are joined on the main thread. The force pass then walks
+// the tree for chunks of sorted particles, so neighbouring threads read the same
+// cells. Each particle's result depends only on the tree, so it is the same for any
+// number of threads.
+struct Nbody_Node {
+    double mass, x, y;          // Total mass and centre of mass
+    double size;                // Side of the square cell
+    int first, count;           // The cell's particles in sorted order
+    int child[4];               // -1 where a quadrant is empty or the node is a leaf
+};
+
+struct Nbody {
+    double theta;
+    double g;                   // px^3 per step^2 per unit mass
+    int capacity;
+    int n;                      // Particles in the tree
+    Uint32 *key;                // Morton key of every particle slot
+    int *order, *scratch;       // Slots sorted by key, and the radix sort buffer
+    Uint32 *sorted_key;
+    double *sorted_x, *sorted_y, *sorted_m;
+    int bucket_start[NBODY_BUCKETS + 1];
+    int bucket_nodes[NBODY_BUCKETS];    // Node count of each bucket subtree
+    int bucket_first[NBODY_BUCKETS];    // First node of each bucket subtree
+    int bucket_root[NBODY_BUCKETS];     // -1 for an empty bucket
+    struct Nbody_Node *nodes;
+    int node_count, node_capacity;
+    struct Particles *particles;
+    SDL_atomic_t next_task;
+};
+
+void nbody_init(struct Nbody *nb, double theta, double g) {
+    memset(nb, 0, sizeof(*nb));
+    nb->theta = theta;
+    nb->g = g;
+}
+
+void nbody_free_particles(struct Nbody *nb) {
+    free(nb->key);
+    free(nb->order);
+    free(nb->scratch);
+    free(nb->sorted_key);
+    free(nb->sorted_x);
+    free(nb->sorted_y);
+    free(nb->sorted_m);
+}
+
+void nbody_free(struct Nbody *nb) {
+    nbody_free_particles(nb);
+    free(nb->nodes);
+}
+
+// The per-particle arrays are rebuilt every step, so growing them needs no copy
+int nbody_reserve(struct Nbody *nb, int capacity) {
+    if (capacity <= nb->capacity) return 0;
+    nbody_free_particles(nb);
+    nb->capacity = 0;
+    nb->key = malloc(sizeof(Uint32) * capacity);
+    nb->order = malloc(sizeof(int) * capacity);
+    nb->scratch = malloc(sizeof(int) * capacity);
+    nb->sorted_key = malloc(sizeof(Uint32) * capacity);
+    nb->sorted_x = malloc(sizeof(double) * capacity);
+    nb->sorted_y = malloc(sizeof(double) * capacity);
+    nb->sorted_m = malloc(sizeof(double) * capacity);
+    if (!nb->key || !nb->order || !nb->scratch || !nb->sorted_key ||
+        !nb->sorted_x || !nb->sorted_y || !nb->sorted_m) return -1;
+    nb->capacity = capacity;
+    return 0;
+}
+
+// Spreads the low 16 bits of v to the even bits
+Uint32 nbody_spread(Uint32 v) {
+    v &= 0xFFFF;
+    v = (v | (v << 8)) & 0x00FF00FF;
+    v = (v | (v << 4)) & 0x0F0F0F0F;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+Uint32 nbody_key(double x, double y) {
+    double scale = (1 << NBODY_KEY_BITS) / (double)NBODY_SIDE;
+    int qx = (int)(x * scale), qy = (int)(y * scale);
+    int max = (1 << NBODY_KEY_BITS) - 1;
+    qx = qx < 0 ? 0 : qx > max ? max : qx;
+    qy = qy < 0 ? 0 : qy > max ? max : qy;
+    return (nbody_spread(qy) << 1) | nbody_spread(qx);
+}
+
+// Quadrant of a node at the given depth that the key falls in, the root being depth 0
+int nbody_digit(Uint32 key, int depth) {
+    return (key >> (2 * (NBODY_KEY_BITS - 1 - depth))) & 3;
+}
+
+void nbody_keys_job(struct Collision_Pool *pool) {
+    struct Nbody *nb = pool->job_data;
+    struct Particles *p = nb->particles;
+    while (1) {
+        int first = SDL_AtomicAdd(&nb->next_task, NBODY_CHUNK);
+        if (first >= p->count) break;
+        int last = first + NBODY_CHUNK < p->count ? first + NBODY_CHUNK : p->count;
+        for (int i = first; i < last; i++) nb->key[i] = nbody_key(p->x[i], p->y[i]);
+    }
+}
+
+// Builds the subtree of sorted particles [first, last), a cell of the given depth and
+// side. Nodes are numbered from *cursor on; with nodes NULL they are only counted.
+// Returns the index of the subtree's root.
+int nbody_build(struct Nbody *nb, struct Nbody_Node *nodes, int *cursor,
+                int first, int last, int depth, double size) {
+    int index = (*cursor)++;
+    int split = last - first > NBODY_LEAF_SIZE && depth < NBODY_KEY_BITS;
+    struct Nbody_Node node = {0, 0, 0, size, first, last - first, {-1, -1, -1, -1}};
+    if (split) {
+        int start = first;
+        for (int q = 0; q < 4; q++) {
+            // The range is sorted, so the quadrant ends at the first key of a later one
+            int lo = start, hi = last;
+            while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                if (nbody_digit(nb->sorted_key[mid], depth) <= q) lo = mid + 1;
+                else hi = mid;
+            }
+            if (lo > start) {
+                node.child[q] = nbody_build(nb, nodes, cursor, start, lo, depth + 1, size / 2);
+                if (nodes) {
+                    struct Nbody_Node *child = &nodes[node.child[q]];
+                    node.mass += child->mass;
+                    node.x += child->mass * child->x;
+                    node.y += child->mass * child->y;
+                }
+            }
+            start = lo;
+        }
+    } else if (nodes) {
+        for (int k = first; k < last; k++) {
+            node.mass += nb->sorted_m[k];
+            node.x += nb->sorted_m[k] * nb->sorted_x[k];
+            node.y += nb->sorted_m[k] * nb->sorted_y[k];
+        }
+    }
+    if (nodes) {
+        if (node.mass > 0) {
+            node.x /= node.mass;
+            node.y /= node.mass;
+        }
+        nodes[index] = node;
+    }
+    return index;
+}
+
+// Sorts each claimed bucket by key, gathers its particles and counts its nodes
+void nbody_sort_job(struct Collision_Pool *pool) {
+    struct Nbody *nb = pool->job_data;
+    struct Particles *p = nb->particles;
+    while (1) {
+        int b = SDL_AtomicAdd(&nb->next_task, 1);
+        if (b >= NBODY_BUCKETS) break;
+        int first = nb->bucket_start[b], last = nb->bucket_start[b + 1];
+        // LSD radix sort, 8 bits a pass. The pass count is even, so the result ends up in order.
+        int *from = nb->order + first, *to = nb->scratch + first;
+        for (int shift = 0; shift < 32; shift += 8) {
+            int counts[257] = {0};
+            for (int k = 0; k < last - first; k++) counts[((nb->key[from[k]] >> shift) & 0xFF) + 1]++;
+            for (int d = 1; d <= 256; d++) counts[d] += counts[d - 1];
+            for (int k = 0; k < last - first; k++) to[counts[(nb->key[from[k]] >> shift) & 0xFF]++] = from[k];
+            int *swap = from;
+            from = to;
+            to = swap;
+        }
+        for (int k = first; k < last; k++) {
+            int i = nb->order[k];
+            nb->sorted_key[k] = nb->key[i];
+            nb->sorted_x[k] = p->x[i];
+            nb->sorted_y[k] = p->y[i];
+            nb->sorted_m[k] = p->m[i];
+        }
+        int cursor = 0;
+        if (last > first) {
+            nbody_build(nb, NULL, &cursor, first, last, NBODY_TOP_LEVELS, NBODY_SIDE / 8.0);
+        }
+        nb->bucket_nodes[b] = cursor;
+    }
+}
+
+void nbody_build_job(struct Collision_Pool *pool) {
+    struct Nbody *nb = pool->job_data;
+    while (1) {
+        int b = SDL_AtomicAdd(&nb->next_task, 1);
+        if (b >= NBODY_BUCKETS) break;
+        int first = nb->bucket_start[b], last = nb->bucket_start[b + 1];
+        int cursor = nb->bucket_first[b];
+        nb->bucket_root[b] = last > first
+            ? nbody_build(nb, nb->nodes, &cursor, first, last, NBODY_TOP_LEVELS, NBODY_SIDE / 8.0)
+            : -1;
+    }
+}
+
+// Joins four children into the top-level node at index
+void nbody_join(struct Nbody *nb, int index, const int *children, double size) {
+    struct Nbody_Node node = {0, 0, 0, size, 0, 0, {-1, -1, -1, -1}};
+    node.first = -1;
+    for (int q = 0; q < 4; q++) {
+        if (children[q] < 0) continue;
+        struct Nbody_Node *child = &nb->nodes[children[q]];
+        if (child->count == 0) continue;
+        node.child[q] = children[q];
+        if (node.first < 0) node.first = child->first;
+        node.count += child->count;
+        node.mass += child->mass;
+        node.x += child->mass * child->x;
+        node.y += child->mass * child->y;
+    }
+    if (node.first < 0) node.first = 0;
+    if (node.mass > 0) {
+        node.x /= node.mass;
+        node.y /= node.mass;
+    }
+    nb->nodes[index] = node;
+}
+
+// Acceleration of sorted particle k, px per step^2
+void nbody_accelerate(const struct Nbody *nb, int k, double *ax, double *ay) {
+    const double theta2 = nb->theta * nb->theta;
+    const double eps2 = (double)NBODY_SOFTENING * NBODY_SOFTENING;
+    double xi = nb->sorted_x[k], yi = nb->sorted_y[k];
+    double sum_x = 0, sum_y = 0;
+    int stack[4 * NBODY_KEY_BITS + 4];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const struct Nbody_Node *node = &nb->nodes[stack[--top]];
+        if (node->count == 0) continue;
+        double dx = node->x - xi, dy = node->y - yi;
+        double d2 = dx * dx + dy * dy;
+        int leaf = node->child[0] < 0 && node->child[1] < 0 && node->child[2] < 0 && node->child[3] < 0;
+        if (leaf) {
+            // The particle itself adds nothing: its offset is zero and the softening keeps it finite
+            for (int j = node->first; j < node->first + node->count; j++) {
+                double jx = nb->sorted_x[j] - xi, jy = nb->sorted_y[j] - yi;
+                double r2 = jx * jx + jy * jy + eps2;
+                double pull = nb->sorted_m[j] / (r2 * sqrt(r2));
+                sum_x += pull * jx;
+                sum_y += pull * jy;
+            }
+        } else if (node->size * node->size < theta2 * d2) {
+            double r2 = d2 + eps2;
+            double pull = node->mass / (r2 * sqrt(r2));
+            sum_x += pull * dx;
+            sum_y += pull * dy;
+        } else {
+            for (int q = 3; q >= 0; q--) {
+                if (node->child[q] >= 0) stack[top++] = node->child[q];
             }
         }
     }
+    *ax = nb->g * sum_x;
+    *ay = nb->g * sum_y;
 }
 
-int main() {
+// Adds each claimed particle's acceleration to its velocity
+void nbody_kick_job(struct Collision_Pool *pool) {
+    PROFILE_SCOPE("forces");
+    struct Nbody *nb = pool->job_data;
+    struct Particles *p = nb->particles;
+    while (1) {
+        int first = SDL_AtomicAdd(&nb->next_task, NBODY_CHUNK);
+        if (first >= nb->n) break;
+        int last = first + NBODY_CHUNK < nb->n ? first + NBODY_CHUNK : nb->n;
+        for (int k = first; k < last; k++) {
+            double ax, ay;
+            nbody_accelerate(nb, k, &ax, &ay);
+            p->velocity_x[nb->order[k]] += ax;
+            p->velocity_y[nb->order[k]] += ay;
+        }
+    }
+}
+
+// Rebuilds the quadtree and applies one step of mutual gravity to every velocity
+void nbody_step(struct Nbody *nb, struct Collision_Pool *pool, struct Particles *p) {
+    PROFILE_SCOPE("gravity");
+    if (nbody_reserve(nb, p->capacity) != 0) return;
+    int helpers = p->alive >= PARALLEL_MIN_PARTICLES ? pool->num_threads - 1 : 0;
+    nb->particles = p;
+
+    SDL_AtomicSet(&nb->next_task, 0);
+    pool_run(pool, nbody_keys_job, nb, helpers);
+
+    // Counting sort of the live particles into buckets by their top 6 key bits
+    int counts[NBODY_BUCKETS] = {0};
+    for (int i = 0; i < p->count; i++) {
+        if (!p->dead[i]) counts[nb->key[i] >> (2 * NBODY_KEY_BITS - 2 * NBODY_TOP_LEVELS)]++;
+    }
+    nb->bucket_start[0] = 0;
+    for (int b = 0; b < NBODY_BUCKETS; b++) nb->bucket_start[b + 1] = nb->bucket_start[b] + counts[b];
+    nb->n = nb->bucket_start[NBODY_BUCKETS];
+    memcpy(counts, nb->bucket_start, sizeof(counts));
+    for (int i = 0; i < p->count; i++) {
+        if (!p->dead[i]) nb->order[counts[nb->key[i] >> (2 * NBODY_KEY_BITS - 2 * NBODY_TOP_LEVELS)]++] = i;
+    }
+
+    SDL_AtomicSet(&nb->next_task, 0);
+    pool_run(pool, nbody_sort_job, nb, helpers);
+
+    int node_count = NBODY_TOP_NODES;
+    for (int b = 0; b < NBODY_BUCKETS; b++) {
+        nb->bucket_first[b] = node_count;
+        node_count += nb->bucket_nodes[b];
+    }
+    if (node_count > nb->node_capacity) {
+        struct Nbody_Node *nodes = realloc(nb->nodes, sizeof(struct Nbody_Node) * node_count * 2);
+        if (nodes == NULL) return;
+        nb->nodes = nodes;
+        nb->node_capacity = node_count * 2;
+    }
+    nb->node_count = node_count;
+
+    SDL_AtomicSet(&nb->next_task, 0);
+    pool_run(pool, nbody_build_job, nb, helpers);
+
+    // Levels 2, 1 and 0 above the buckets. Bucket b sits at quadrants b >> 4, (b >> 2) & 3, b & 3.
+    for (int m = 0; m < 16; m++) nbody_join(nb, 5 + m, &nb->bucket_root[4 * m], NBODY_SIDE / 4.0);
+    for (int q = 0; q < 4; q++) {
+        int children[4] = {5 + 4 * q, 6 + 4 * q, 7 + 4 * q, 8 + 4 * q};
+        nbody_join(nb, 1 + q, children, NBODY_SIDE / 2.0);
+    }
+    int quadrants[4] = {1, 2, 3, 4};
+    nbody_join(nb, 0, quadrants, NBODY_SIDE);
+
+    SDL_AtomicSet(&nb->next_task, 0);
+    pool_run(pool, nbody_kick_job, nb, helpers);
+}
+
+int main(int argc, char *argv[]) {
+    // --sprites: draw all particles with one textured SDL_RenderGeometry call per radius class
+    // --threads N: threads resolving contacts, results do not depend on it
+    // --seed N: seed of the collision jitter and particle colours
+    // --events: exact event-driven collisions instead of fixed steps with overlap tests
+    // --nbody: particles attract each other instead of falling, --theta T sets the Barnes-Hut opening angle
+    int use_sprites = 0;
+    int use_events = 0;
+    // --load PATH: start from a snapshot, --snapshot PATH: where S saves one
+    // --log-input PATH: record the mouse input, --replay PATH: play a recorded run back exactly
+    int use_nbody = 0;
+    double theta = NBODY_THETA;
+    const char *load_path = NULL, *snapshot_path = SNAPSHOT_PATH;
+    const char *log_path = NULL, *replay_path = NULL;
+    int num_threads = SDL_GetCPUCount();
+    Uint64 seed = DEFAULT_SEED;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--sprites") == 0) use_sprites = 1;
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) num_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--events") == 0) use_events = 1;
+        else if (strcmp(argv[i], "--nbody") == 0) use_nbody = 1;
+        else if (strcmp(argv[i], "--theta") == 0 && i + 1 < argc) theta = atof(argv[++i]);
+        else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) load_path = argv[++i];
+        else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) snapshot_path = argv[++i];
+        else if (strcmp(argv[i], "--log-input") == 0 && i + 1 < argc) log_path = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) replay_path = argv[++i];
+    }
+    if (num_threads < 1) num_threads = 1;
+    if (use_nbody && use_events) {
+        printf("Event mode needs uniform gravity, ignoring --events\n");
+        use_events = 0;
+    }
+    // --profile shows the frame profiler overlay, --trace PATH writes a Chrome trace at exit
+    profile_parse_args(argc, argv);
+
     SDL_Init(SDL_INIT_VIDEO);
     SDL_Window *window = SDL_CreateWindow("Gravity_Ball", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
 
-    struct Circle *circles = NULL;
-    int circle_count = 0;
-    double acceleration = Gravity * 0.001;
+    struct Particles particles = {0};
+    particles.seed = seed;
+    particles_reserve(&particles, INITIAL_CAPACITY);
+    double spawn_x[SPAWN_BATCH], spawn_y[SPAWN_BATCH];
+    Uint32 step = 0;
+    static struct Snapshot snapshot;
+    if (load_path && (snapshot_open(&snapshot, load_path) != 0 || particles_load(&particles, &snapshot, &step) != 0)) {
+        printf("Could not load a particle snapshot from %s\n", load_path);
+        snapshot_close(&snapshot);
+        return 1;
+    }
+    struct Input_Replay replay = {0};
+    if (replay_path) {
+        if (input_replay_open(&replay, replay_path) != 0) {
+            printf("Could not read an input log from %s\n", replay_path);
+            return 1;
+        }
+        particles.seed = replay.seed;
+    }
+    int replay_ended = 0;
+    struct Input_Log input_log = {0};
+    if (log_path && input_log_open(&input_log, log_path, particles.seed) != 0) {
+        printf("Could not write an input log to %s\n", log_path);
+        return 1;
+    }
+    int shown_count = -1;
+    integrate_fn integrate = select_integrator();
+    // Physics runs in fixed steps of dt; velocities are in px per step
+    double dt = 1.0 / PHYSICS_HZ;
+    double acceleration = Gravity * PIXELS_PER_METER * dt * dt;
+    double jitter = JITTER_SPEED * dt;
     double e = COEFF_OF_RESTITUTION;
+    struct Grid grid;
+    grid_init(&grid);
+    static struct Collision_Pool pool;
+    if (collision_pool_create(&pool, num_threads) != 0) {
+        printf("Could not start all collision threads, using %d\n", pool.num_threads);
+    }
+    struct Event_World world;
+    event_world_init(&world, acceleration, e);
+    world.now = step;
+    struct Nbody nbody;
+    nbody_init(&nbody, theta, NBODY_G * dt * dt);
+    struct Sprite_Batch batch = {0};
+
+    double accumulator = 0;
+    double frequency = (double)SDL_GetPerformanceFrequency();
+    Uint64 last_time = SDL_GetPerformanceCounter();
+    int skipped_frames = 0;
 
     int simulation_running = 1;
     SDL_Event event;
 
     while (simulation_running) {
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); // Background Color
-        SDL_RenderClear(renderer);
-
-        // draw_grid(renderer);
-
+        // Motion events are queued and spawned as one batch per frame
+        int spawn_count = 0;
         while (SDL_PollEvent(&event)) {
             if (event.type == SDL_QUIT) {
                 simulation_running = 0;
             }
-            if (event.type == SDL_MOUSEMOTION) {
-                circle_count++;
-                circles = realloc(circles, sizeof(struct Circle) * circle_count);
-                printf("Circle %d created at (%d, %d)\n", circle_count, event.button.x, event.button.y);
-                printf("Size of circle array: %ld Bytes\n", sizeof(struct Circle) * circle_count);
-                circles[circle_count - 1].x = event.button.x;
-                circles[circle_count - 1].y = event.button.y;
-                circles[circle_count - 1].r = RADIUS;
-                circles[circle_count - 1].m = 1.0;
-                circles[circle_count - 1].velocity_y = VELOCITY_Y;
-                circles[circle_count - 1].velocity_x = VELOCITY_X;
-                circles[circle_count - 1].red = rand() % 255;
-                circles[circle_count - 1].green = rand() % 255;
-                circles[circle_count - 1].blue = rand() % 255;
-                circles[circle_count - 1].a = 255;
-            }
-        }
-
-        for (int i = 0; i < circle_count; i++) {
-            circles[i].velocity_y += acceleration;
-            circles[i].y += circles[i].velocity_y;
-            circles[i].x += circles[i].velocity_x;
-            
-            if(circles[i].x + circles[i].r > WIDTH){
-                circles[i].x = WIDTH - circles[i].r;
-                circles[i].velocity_x = -circles[i].velocity_x * e;
-            }
-            if(circles[i].x - circles[i].r < 0){
-                circles[i].x = 0 + circles[i].r;
-                circles[i].velocity_x = -circles[i].velocity_x * e;
-            }
-            if (circles[i].y + circles[i].r > HEIGHT) {
-                circles[i].y = HEIGHT - circles[i].r;
-                circles[i].velocity_y = -circles[i].velocity_y * e;
-            }
-            if(circles[i].y - circles[i].r < 0){
-                circles[i].y = 0 + circles[i].r;
-                circles[i].velocity_y = -circles[i].velocity_y * e;
-            }
-
-            // Collision Detection
-
-            for (int j = i + 1; j < circle_count; j++) {
-                double dx = circles[i].x - circles[j].x;
-                double dy = circles[i].y - circles[j].y;
-                double distance = sqrt(dx * dx + dy * dy);
-                if (distance < circles[i].r + circles[j].r) {
-                    double angle = atan2(dy, dx);
-                    double overlap = (circles[i].r + circles[j].r) - distance;
-
-                    circles[i].x += cos(angle) * overlap / 2;
-                    circles[i].y += sin(angle) * overlap / 2;
-                    circles[j].x -= cos(angle) * overlap / 2;
-                    circles[j].y -= sin(angle) * overlap / 2;
-
-                    double nx = dx / distance;
-                    double ny = dy / distance;
-                    double vix = circles[i].velocity_x;
-                    double viy = circles[i].velocity_y;
-                    double vjx = circles[j].velocity_x;
-                    double vjy = circles[j].velocity_y;
-
-                    double vi = vix * nx + viy * ny;
-                    double vj = vjx * nx + vjy * ny;
-
-                    double vi_new = vj + e * (vi - vj);
-                    double vj_new = vi + e * (vj - vi);
-
-                    circles[i].velocity_x += (double)rand() / RAND_MAX * 2.0 - 1.0 + (vi_new - vi) * nx;
-                    circles[i].velocity_y += (double)rand() / RAND_MAX * 2.0 - 1.0 + (vi_new - vi) * ny;
-                    circles[j].velocity_x += (double)rand() / RAND_MAX * 2.0 - 1.0 + (vj_new - vj) * nx;
-                    circles[j].velocity_y += (double)rand() / RAND_MAX * 2.0 - 1.0 + (vj_new - vj) * ny;
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_p) {
+                profile_toggle_overlay();
+            }
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_s) {
+                if (particles_save(&particles, step, snapshot_path) == 0) {
+                    printf("Saved %d particles at step %u to %s\n", particles.alive, step, snapshot_path);
+                } else {
+                    printf("Could not save a snapshot to %s\n", snapshot_path);
                 }
-            
-            
+            }
+            if (event.type == SDL_MOUSEMOTION && !replay_path) {
+                if (spawn_count == SPAWN_BATCH) {
+                    particles_spawn(&particles, spawn_x, spawn_y, spawn_count, step);
+                    spawn_count = 0;
+                }
+                spawn_x[spawn_count] = event.motion.x;
+                spawn_y[spawn_count] = event.motion.y;
+                spawn_count++;
+                input_log_write(&input_log, step, INPUT_POINTER, event.motion.x, event.motion.y);
+            }
         }
+        particles_spawn(&particles, spawn_x, spawn_y, spawn_count, step);
+        if (replay_path && !replay_ended) replay_ended = replay_spawn(&replay, &particles, step);
 
-            draw_circle(renderer, circles[i], circles[i].red, circles[i].green, circles[i].blue, circles[i].a);
+        if (particles.alive != shown_count) {
+            char title[64];
+            snprintf(title, sizeof(title), "Gravity_Ball - %d particles", particles.alive);
+            SDL_SetWindowTitle(window, title);
+            shown_count = particles.alive;
         }
 
+        Uint64 now = SDL_GetPerformanceCounter();
+        double frame_time = (now - last_time) / frequency;
+        last_time = now;
+        if (frame_time > MAX_FRAME_TIME) frame_time = MAX_FRAME_TIME;
+        accumulator += frame_time;
+
+        while (accumulator >= dt && !replay_ended) {
+            // A replay feeds the recorded input before the same steps it was given to
+            if (replay_path && replay_spawn(&replay, &particles, step)) {
+                replay_ended = 1;
+                break;
+            }
+            if (PARTICLE_LIFETIME > 0) {
+                particles_expire(&particles, step, PARTICLE_LIFETIME);
+            }
+            memcpy(particles.previous_x, particles.x, sizeof(double) * particles.count);
+            memcpy(particles.previous_y, particles.y, sizeof(double) * particles.count);
+
+            if (use_events) {
+                Uint64 events_start = profile_now();
+                event_track(&world, &particles);
+                event_run(&world, &particles, step + 1);
+                profile_record("events", events_start);
+            } else {
+                if (use_nbody) nbody_step(&nbody, &pool, &particles);
+                Uint64 integrate_start = profile_now();
+                integrate(&particles, use_nbody ? 0.0 : acceleration, e);
+                profile_record("integrate", integrate_start);
+
+                // Collision Detection
+                collide_particles(&grid, &pool, &particles, e, jitter, step);
+            }
+
+            accumulator -= dt;
+            step++;
+        }
+
+        if (replay_ended) simulation_running = 0;
+
+        // Physics has priority: if it used up the frame budget, skip drawing this time
+        double physics_time = (SDL_GetPerformanceCounter() - now) / frequency;
+        if (physics_time > FRAME_BUDGET && skipped_frames < MAX_SKIPPED_FRAMES) {
+            skipped_frames++;
+            profile_frame();
+            continue;
+        }
+        skipped_frames = 0;
+
+        // Draw between the last two physics states
+        double alpha = accumulator / dt;
+
+        Uint64 rasterize_start = profile_now();
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); // Background Color
+        SDL_RenderClear(renderer);
+
+        // draw_grid(renderer);
+
+        if (use_sprites) {
+            draw_particles_batched(renderer, &batch, &particles, alpha);
+        } else {
+            for (int i = 0; i < particles.count; i++) {
+                if (particles.dead[i]) continue;
+                double x = particles.previous_x[i] + (particles.x[i] - particles.previous_x[i]) * alpha;
+                double y = particles.previous_y[i] + (particles.y[i] - particles.previous_y[i]) * alpha;
+                struct Circle circle = {x, y, particles.r[i]};
+                struct Particle_Color c = particles.color[i];
+                draw_circle(renderer, circle, c.red, c.green, c.blue, c.a);
+            }
+        }
+        profile_draw_renderer(renderer);
+        profile_record("rasterize", rasterize_start);
+
+        Uint64 present_start = profile_now();
         SDL_RenderPresent(renderer);
-        SDL_Delay(1); // Approximately 1000 FPS
+        profile_record("present", present_start);
+        profile_frame();
+        SDL_Delay(1);
+    }
+    profile_shutdown();
+
+    if (log_path || replay_path) {
+        printf("%s %u steps, state hash %016llx\n", replay_path ? "Replayed" : "Recorded", step,
+               (unsigned long long)particles_hash(&particles));
     }
+    if (log_path && input_log_close(&input_log, step) != 0) printf("Could not write the input log to %s\n", log_path);
+    input_replay_close(&replay);
 
-    free(circles);
+    particles_free(&particles);
+    grid_free(&grid);
+    collision_pool_destroy(&pool);
+    event_world_free(&world);
+    nbody_free(&nbody);
+    sprite_batch_free(&batch);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
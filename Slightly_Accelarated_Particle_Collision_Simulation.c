@@ -2,6 +2,8 @@
 #include <math.h>
 #include <SDL2/SDL.h>
 #include <stdlib.h>
+#include "Profiler.h"
+#include "Random.h"
 
 #define WIDTH 1000
 #define HEIGHT 800
@@ -20,6 +22,12 @@
 #define VELOCITY_X 1.0
 #define VELOCITY_Y 1.0
 #define COEFF_OF_RESTITUTION 0.4
+#define RANDOM_SEED 1
+
+// Random counters keep the frame in the high half and what the number is for in
+// the low half: jitter against another circle, or a colour channel
+#define JITTER_COUNTER(step, other, axis) (((Uint64)(step) << 32) | ((Uint64)(other) << 1) | (Uint64)(axis))
+#define COLOR_COUNTER(step, channel) (((Uint64)(step) << 32) | 0x80000000u | (Uint64)(channel))
 
 struct Circle {
     double m;
@@ -52,7 +60,9 @@ void draw_circle(SDL_Renderer *renderer, struct Circle circle, Uint8 r, Uint8 g,
     }
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    // --profile shows the frame profiler overlay, --trace PATH writes a Chrome trace at exit
+    profile_parse_args(argc, argv);
     SDL_Init(SDL_INIT_VIDEO);
     SDL_Window *window = SDL_CreateWindow("Gravity_Ball", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT, 0);
     SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
@@ -64,6 +74,7 @@ int main() {
 
     int simulation_running = 1;
     SDL_Event event;
+    Uint32 step = 0;
 
     while (simulation_running) {
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); // Background Color
@@ -75,6 +86,9 @@ int main() {
             if (event.type == SDL_QUIT) {
                 simulation_running = 0;
             }
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_p) {
+                profile_toggle_overlay();
+            }
             if (event.type == SDL_MOUSEMOTION) {
                 circle_count++;
                 circles = realloc(circles, sizeof(struct Circle) * circle_count);
@@ -86,13 +100,16 @@ int main() {
                 circles[circle_count - 1].m = 1.0;
                 circles[circle_count - 1].velocity_y = VELOCITY_Y;
                 circles[circle_count - 1].velocity_x = VELOCITY_X;
-                circles[circle_count - 1].red = rand() % 255;
-                circles[circle_count - 1].green = rand() % 255;
-                circles[circle_count - 1].blue = rand() % 255;
+                Uint64 key = random_key(RANDOM_SEED, circle_count - 1);
+                circles[circle_count - 1].red = (Uint8)(random_uniform_keyed(key, COLOR_COUNTER(step, 0)) * 255);
+                circles[circle_count - 1].green = (Uint8)(random_uniform_keyed(key, COLOR_COUNTER(step, 1)) * 255);
+                circles[circle_count - 1].blue = (Uint8)(random_uniform_keyed(key, COLOR_COUNTER(step, 2)) * 255);
                 circles[circle_count - 1].a = 255;
             }
         }
 
+        // Integration, collisions and drawing share one pass, so they are timed together
+        Uint64 simulate_start = profile_now();
         for (int i = 0; i < circle_count; i++) {
             circles[i].velocity_y += acceleration;
             circles[i].y += circles[i].velocity_y;
@@ -143,10 +160,11 @@ int main() {
                     double vi_new = vj + e * (vi - vj);
                     double vj_new = vi + e * (vj - vi);
 
-                    circles[i].velocity_x += (double)rand() / RAND_MAX * 2.0 - 1.0 + (vi_new - vi) * nx;
-                    circles[i].velocity_y += (double)rand() / RAND_MAX * 2.0 - 1.0 + (vi_new - vi) * ny;
-                    circles[j].velocity_x += (double)rand() / RAND_MAX * 2.0 - 1.0 + (vj_new - vj) * nx;
-                    circles[j].velocity_y += (double)rand() / RAND_MAX * 2.0 - 1.0 + (vj_new - vj) * ny;
+                    Uint64 key_i = random_key(RANDOM_SEED, i), key_j = random_key(RANDOM_SEED, j);
+                    circles[i].velocity_x += random_signed_keyed(key_i, JITTER_COUNTER(step, j, 0)) + (vi_new - vi) * nx;
+                    circles[i].velocity_y += random_signed_keyed(key_i, JITTER_COUNTER(step, j, 1)) + (vi_new - vi) * ny;
+                    circles[j].velocity_x += random_signed_keyed(key_j, JITTER_COUNTER(step, i, 0)) + (vj_new - vj) * nx;
+                    circles[j].velocity_y += random_signed_keyed(key_j, JITTER_COUNTER(step, i, 1)) + (vj_new - vj) * ny;
                 }
             
             
@@ -154,10 +172,17 @@ int main() {
 
             draw_circle(renderer, circles[i], circles[i].red, circles[i].green, circles[i].blue, circles[i].a);
         }
+        profile_record("simulate", simulate_start);
+        step++;
+        profile_draw_renderer(renderer);
 
+        Uint64 present_start = profile_now();
         SDL_RenderPresent(renderer);
+        profile_record("present", present_start);
+        profile_frame();
         SDL_Delay(1); // Approximately 1000 FPS
     }
+    profile_shutdown();
 
     free(circles);
     SDL_DestroyRenderer(renderer);
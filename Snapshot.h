@@ -0,0 +1,343 @@
+// Binary snapshots and input logs shared by the simulations.
+//
+// A snapshot is a header, a fixed table of tagged chunks and the chunk data:
+//
+//   header   "PGSNAP\r\n", format version, chunk count, file size
+//   table    SNAPSHOT_MAX_CHUNKS entries of tag, chunk version, offset, size
+//   chunks   raw arrays, each starting on a 64-byte boundary
+//
+// Loading maps the file copy-on-write and hands out pointers straight into the
+// mapping, so the arrays are used in place: nothing is parsed or copied, and a
+// page is only read from disk and duplicated when the simulation first touches
+// it. Each chunk carries its own version, so one simulation can change its
+// layout without breaking the others. Everything is stored in the host's byte
+// order, which is little endian on every platform the simulations build for.
+//
+// An input log records what the user did, keyed by physics step, so a run can
+// be replayed exactly from its seed (and optionally a snapshot):
+//
+//   header   "PGINPUT\n", format version, seed
+//   events   step delta, type, two zigzag values, each a LEB128 varint
+//
+// A mouse sample is typically 6 bytes.
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SNAPSHOT_MMAP 1
+#endif
+
+#define SNAPSHOT_MAGIC "PGSNAP\r\n"     // The \r\n catches text-mode transfers
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAX_CHUNKS 16
+#define SNAPSHOT_ALIGN 64
+#define SNAPSHOT_TAG(a, b, c, d) ((Uint32)(a) | (Uint32)(b) << 8 | (Uint32)(c) << 16 | (Uint32)(d) << 24)
+
+#define INPUT_LOG_MAGIC "PGINPUT\n"
+#define INPUT_LOG_VERSION 1
+
+struct Snapshot_Header {
+    char magic[8];
+    Uint32 version;
+    Uint32 chunk_count;
+    Uint64 file_size;
+};
+
+struct Snapshot_Chunk {
+    Uint32 tag;
+    Uint32 version;
+    Uint64 offset;
+    Uint64 size;
+};
+
+struct Snapshot_Writer {
+    FILE *out;
+    struct Snapshot_Chunk chunks[SNAPSHOT_MAX_CHUNKS];
+    int chunk_count;
+    Uint64 offset;
+    int failed;
+};
+
+struct Snapshot {
+    char *base;
+    size_t size;
+    int mapped;                 // base is a mapping rather than an allocation
+    const struct Snapshot_Header *header;
+    const struct Snapshot_Chunk *chunks;
+};
+
+static inline size_t snapshot_table_end(void) {
+    return sizeof(struct Snapshot_Header) + SNAPSHOT_MAX_CHUNKS * sizeof(struct Snapshot_Chunk);
+}
+
+// Returns 0 on success
+static inline int snapshot_begin(struct Snapshot_Writer *w, const char *path) {
+    memset(w, 0, sizeof(*w));
+    w->out = fopen(path, "wb");
+    if (w->out == NULL) return -1;
+    // The header and table are filled in by snapshot_end
+    static const char zeros[sizeof(struct Snapshot_Header) + SNAPSHOT_MAX_CHUNKS * sizeof(struct Snapshot_Chunk)];
+    if (fwrite(zeros, 1, sizeof(zeros), w->out) != sizeof(zeros)) w->failed = 1;
+    w->offset = sizeof(zeros);
+    return 0;
+}
+
+static inline void snapshot_add(struct Snapshot_Writer *w, Uint32 tag, Uint32 version, const void *data, size_t size) {
+    if (w->chunk_count == SNAPSHOT_MAX_CHUNKS) {
+        w->failed = 1;
+        return;
+    }
+    static const char padding[SNAPSHOT_ALIGN];
+    size_t pad = (SNAPSHOT_ALIGN - w->offset % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN;
+    if (fwrite(padding, 1, pad, w->out) != pad) w->failed = 1;
+    w->offset += pad;
+    struct Snapshot_Chunk chunk = {tag, version, w->offset, size};
+    w->chunks[w->chunk_count++] = chunk;
+    if (size > 0 && fwrite(data, 1, size, w->out) != size) w->failed = 1;
+    w->offset += size;
+}
+
+// Writes the header and table and closes the file. Returns 0 when everything was written.
+static inline int snapshot_end(struct Snapshot_Writer *w) {
+    struct Snapshot_Header header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.chunk_count = (Uint32)w->chunk_count;
+    header.file_size = w->offset;
+    if (fseek(w->out, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, w->out) != 1 ||
+        fwrite(w->chunks, sizeof(struct Snapshot_Chunk), SNAPSHOT_MAX_CHUNKS, w->out) != SNAPSHOT_MAX_CHUNKS) {
+        w->failed = 1;
+    }
+    if (fclose(w->out) != 0) w->failed = 1;
+    return w->failed ? -1 : 0;
+}
+
+static inline void snapshot_close(struct Snapshot *snap) {
+    if (snap->base == NULL) return;
+#ifdef SNAPSHOT_MMAP
+    if (snap->mapped) munmap(snap->base, snap->size);
+    else SDL_SIMDFree(snap->base);
+#else
+    SDL_SIMDFree(snap->base);
+#endif
+    memset(snap, 0, sizeof(*snap));
+}
+
+// Maps path copy-on-write, or reads it into aligned memory where there is no mmap,
+// and checks the header and table. Returns 0 on success.
+static inline int snapshot_open(struct Snapshot *snap, const char *path) {
+    memset(snap, 0, sizeof(*snap));
+#ifdef SNAPSHOT_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < snapshot_table_end()) {
+        close(fd);
+        return -1;
+    }
+    snap->size = (size_t)info.st_size;
+    void *base = mmap(NULL, snap->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+    snap->base = (char *)base;
+    snap->mapped = 1;
+#else
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) return -1;
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    if (size < (long)snapshot_table_end()) {
+        fclose(in);
+        return -1;
+    }
+    snap->size = (size_t)size;
+    snap->base = (char *)SDL_SIMDAlloc(snap->size);
+    int read_ok = snap->base != NULL && fread(snap->base, 1, snap->size, in) == snap->size;
+    fclose(in);
+    if (!read_ok) {
+        snapshot_close(snap);
+        return -1;
+    }
+#endif
+
+    snap->header = (const struct Snapshot_Header *)snap->base;
+    snap->chunks = (const struct Snapshot_Chunk *)(snap->base + sizeof(struct Snapshot_Header));
+    int valid = memcmp(snap->header->magic, SNAPSHOT_MAGIC, sizeof(snap->header->magic)) == 0 &&
+                snap->header->version == SNAPSHOT_VERSION &&
+                snap->header->chunk_count <= SNAPSHOT_MAX_CHUNKS &&
+                snap->header->file_size == snap->size;
+    for (Uint32 c = 0; valid && c < snap->header->chunk_count; c++) {
+        const struct Snapshot_Chunk *chunk = &snap->chunks[c];
+        valid = chunk->offset % SNAPSHOT_ALIGN == 0 && chunk->offset >= snapshot_table_end() &&
+                chunk->offset <= snap->size && chunk->size <= snap->size - chunk->offset;
+    }
+    if (!valid) {
+        snapshot_close(snap);
+        return -1;
+    }
+    return 0;
+}
+
+// The data of chunk tag, or NULL when it is missing or has another version.
+// The memory stays valid, and writable, until snapshot_close.
+static inline void *snapshot_chunk(const struct Snapshot *snap, Uint32 tag, Uint32 version, size_t *size) {
+    for (Uint32 c = 0; c < snap->header->chunk_count; c++) {
+        if (snap->chunks[c].tag == tag && snap->chunks[c].version == version) {
+            *size = (size_t)snap->chunks[c].size;
+            return snap->base + snap->chunks[c].offset;
+        }
+    }
+    return NULL;
+}
+
+enum {
+    INPUT_POINTER = 1,          // a, b: position of a mouse sample
+    INPUT_KEY = 2,              // a: key code
+    INPUT_END = 3               // The run ended at this step
+};
+
+struct Input_Event {
+    Uint32 step;
+    int type;
+    Sint32 a, b;
+};
+
+struct Input_Log {
+    FILE *out;
+    Uint32 last_step;
+    int failed;
+};
+
+struct Input_Replay {
+    Uint8 *data;
+    size_t size, position;
+    Uint64 seed;
+    Uint32 last_step;
+    struct Input_Event next;
+    int has_next;
+};
+
+static inline void input_put_varint(struct Input_Log *log, Uint64 value) {
+    do {
+        Uint8 byte = value & 0x7F;
+        value >>= 7;
+        if (value) byte |= 0x80;
+        if (fputc(byte, log->out) == EOF) log->failed = 1;
+    } while (value);
+}
+
+static inline Uint64 input_zigzag(Sint64 value) {
+    return ((Uint64)value << 1) ^ (Uint64)(value >> 63);
+}
+
+// Returns 0 on success
+static inline int input_log_open(struct Input_Log *log, const char *path, Uint64 seed) {
+    memset(log, 0, sizeof(*log));
+    log->out = fopen(path, "wb");
+    if (log->out == NULL) return -1;
+    Uint32 version = INPUT_LOG_VERSION;
+    if (fwrite(INPUT_LOG_MAGIC, 1, 8, log->out) != 8 ||
+        fwrite(&version, sizeof(version), 1, log->out) != 1 ||
+        fwrite(&seed, sizeof(seed), 1, log->out) != 1) {
+        log->failed = 1;
+    }
+    return 0;
+}
+
+// Events must come in step order
+static inline void input_log_write(struct Input_Log *log, Uint32 step, int type, Sint32 a, Sint32 b) {
+    if (log->out == NULL) return;
+    input_put_varint(log, step - log->last_step);
+    input_put_varint(log, (Uint64)type);
+    input_put_varint(log, input_zigzag(a));
+    input_put_varint(log, input_zigzag(b));
+    log->last_step = step;
+}
+
+// Marks the final step and closes the log. Returns 0 when everything was written.
+static inline int input_log_close(struct Input_Log *log, Uint32 step) {
+    if (log->out == NULL) return 0;
+    input_log_write(log, step, INPUT_END, 0, 0);
+    if (fclose(log->out) != 0) log->failed = 1;
+    log->out = NULL;
+    return log->failed ? -1 : 0;
+}
+
+static inline int input_get_varint(struct Input_Replay *replay, Uint64 *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (replay->position == replay->size) return -1;
+        Uint8 byte = replay->data[replay->position++];
+        *value |= (Uint64)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return 0;
+    }
+    return -1;
+}
+
+// Decodes the next event into replay->next. A truncated log ends where it breaks off.
+static inline void input_replay_advance(struct Input_Replay *replay) {
+    Uint64 delta, type, a, b;
+    replay->has_next = input_get_varint(replay, &delta) == 0 && input_get_varint(replay, &type) == 0 &&
+                       input_get_varint(replay, &a) == 0 && input_get_varint(replay, &b) == 0;
+    if (!replay->has_next) return;
+    replay->last_step += (Uint32)delta;
+    replay->next.step = replay->last_step;
+    replay->next.type = (int)type;
+    replay->next.a = (Sint32)((a >> 1) ^ (~(a & 1) + 1));
+    replay->next.b = (Sint32)((b >> 1) ^ (~(b & 1) + 1));
+}
+
+// Reads the whole log, it is small. Returns 0 on success.
+static inline int input_replay_open(struct Input_Replay *replay, const char *path) {
+    memset(replay, 0, sizeof(*replay));
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) return -1;
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    replay->data = size > 0 ? (Uint8 *)malloc((size_t)size) : NULL;
+    int read_ok = replay->data != NULL && fread(replay->data, 1, (size_t)size, in) == (size_t)size;
+    fclose(in);
+    Uint32 version;
+    if (!read_ok || size < 20 || memcmp(replay->data, INPUT_LOG_MAGIC, 8) != 0) {
+        free(replay->data);
+        return -1;
+    }
+    memcpy(&version, replay->data + 8, sizeof(version));
+    memcpy(&replay->seed, replay->data + 12, sizeof(replay->seed));
+    if (version != INPUT_LOG_VERSION) {
+        free(replay->data);
+        return -1;
+    }
+    replay->size = (size_t)size;
+    replay->position = 20;
+    input_replay_advance(replay);
+    return 0;
+}
+
+// Takes the next event if it happens at or before step. Returns 1 when it did.
+static inline int input_replay_next(struct Input_Replay *replay, Uint32 step, struct Input_Event *event) {
+    if (!replay->has_next || replay->next.step > step) return 0;
+    *event = replay->next;
+    input_replay_advance(replay);
+    return 1;
+}
+
+static inline void input_replay_close(struct Input_Replay *replay) {
+    free(replay->data);
+    memset(replay, 0, sizeof(*replay));
+}
+
+#endif
@@ -0,0 +1,185 @@
+// Exact lit region of a point light among circular obstacles.
+//
+// A pixel is in shadow when the segment from the light to the pixel centre
+// crosses an obstacle. For a circle that set is convex: the near arc of the
+// circle plus the cone between its two tangent rays. Every screen row therefore
+// meets each obstacle's shadow in a single span whose ends lie on a tangent ray
+// or on the near arc. FillVisibility sorts those spans per row and shades the
+// gaps between them, so a frame costs O(rows * obstacles log obstacles + lit
+// pixels) and does not depend on a ray count or leave gaps far from the light.
+
+#ifndef VISIBILITY_H
+#define VISIBILITY_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <SDL2/SDL.h>
+
+#define VISIBILITY_MAX_OCCLUDERS 64
+#define VISIBILITY_FALLOFF 40000.0
+#define VISIBILITY_CUTOFF 0.05
+#define VISIBILITY_FAR 1e9
+
+struct Occluder {
+    double cx, cy, r;
+    double wx, wy;              // light to centre
+    double cone;                // |w|^2 - r^2, the squared cone half-angle cosine times |w|^2
+    double ux[2], uy[2];        // unit directions of the two tangent rays
+    double tangent_length;      // distance from the light to the tangent points
+};
+
+struct Visibility {
+    double light_x, light_y;
+    int blocked;                // the light sits inside an obstacle
+    int count;
+    struct Occluder occluders[VISIBILITY_MAX_OCCLUDERS];
+};
+
+struct Shadow_Span {
+    int first, last;
+};
+
+static void visibility_begin(struct Visibility *v, double light_x, double light_y) {
+    v->light_x = light_x;
+    v->light_y = light_y;
+    v->blocked = 0;
+    v->count = 0;
+}
+
+static void visibility_add(struct Visibility *v, double cx, double cy, double r) {
+    double wx = cx - v->light_x, wy = cy - v->light_y;
+    double d2 = wx * wx + wy * wy;
+    if (d2 <= r * r) {
+        v->blocked = 1;
+        return;
+    }
+    if (v->count == VISIBILITY_MAX_OCCLUDERS) return;
+
+    struct Occluder *o = &v->occluders[v->count++];
+    double d = sqrt(d2);
+    double sin_a = r / d, cos_a = sqrt(1.0 - sin_a * sin_a);
+    double nx = wx / d, ny = wy / d;
+    o->cx = cx;
+    o->cy = cy;
+    o->r = r;
+    o->wx = wx;
+    o->wy = wy;
+    o->cone = d2 - r * r;
+    o->ux[0] = nx * cos_a - ny * sin_a;
+    o->uy[0] = nx * sin_a + ny * cos_a;
+    o->ux[1] = nx * cos_a + ny * sin_a;
+    o->uy[1] = -nx * sin_a + ny * cos_a;
+    o->tangent_length = sqrt(o->cone);
+}
+
+// Is the direction (vx, vy) from the light inside the tangent cone
+static int occluder_in_cone(const struct Occluder *o, double vx, double vy) {
+    double dot = vx * o->wx + vy * o->wy;
+    return dot > 0 && dot * dot >= (vx * vx + vy * vy) * o->cone;
+}
+
+// Shadow of one obstacle on the row at height y, as a range of x.
+// Returns 0 when the row misses it.
+static int occluder_row_span(const struct Occluder *o, double light_x, double light_y, double y,
+                             double *x0, double *x1) {
+    double dy = y - light_y;
+    double lo = INFINITY, hi = -INFINITY;
+
+    // Tangent rays past the tangent points
+    for (int k = 0; k < 2; k++) {
+        if (o->uy[k] == 0) continue;
+        double s = dy / o->uy[k];
+        if (s < o->tangent_length) continue;
+        double x = light_x + s * o->ux[k];
+        if (x < lo) lo = x;
+        if (x > hi) hi = x;
+    }
+
+    // Near arc, the part of the circle that faces the light
+    double ry = y - o->cy;
+    double h = o->r * o->r - ry * ry;
+    if (h >= 0) {
+        double root = sqrt(h);
+        for (int k = -1; k <= 1; k += 2) {
+            double rx = k * root;
+            if (-(rx * o->wx + ry * o->wy) < o->r * o->r - 1e-9) continue;
+            double x = o->cx + rx;
+            if (x < lo) lo = x;
+            if (x > hi) hi = x;
+        }
+    }
+    if (lo > hi) return 0;
+
+    // A single crossing means the cone runs off along the row on one side
+    if (occluder_in_cone(o, -VISIBILITY_FAR - light_x, dy)) lo = -INFINITY;
+    if (occluder_in_cone(o, VISIBILITY_FAR - light_x, dy)) hi = INFINITY;
+    *x0 = lo;
+    *x1 = hi;
+    return 1;
+}
+
+static int shadow_span_compare(const void *a, const void *b) {
+    return ((const struct Shadow_Span *)a)->first - ((const struct Shadow_Span *)b)->first;
+}
+
+// Shades every lit pixel with the inverse-square falloff of the ray tracers.
+// Returns the number of pixels written.
+static long FillVisibility(SDL_Surface *surface, const struct Visibility *v, Uint32 baseColor) {
+    if (v->blocked) return 0;
+
+    Uint32 *pixels = (Uint32 *)surface->pixels;
+    int pitch = surface->pitch / 4;
+    int width = surface->w, height = surface->h;
+    double base_r = (baseColor >> 16) & 0xFF;
+    double base_g = (baseColor >> 8) & 0xFF;
+    double base_b = baseColor & 0xFF;
+    // Past this distance the falloff rounds to the cutoff and the pixel stays black
+    double reach_squared = VISIBILITY_FALLOFF / VISIBILITY_CUTOFF - 1.0;
+    long pixels_written = 0;
+
+    struct Shadow_Span spans[VISIBILITY_MAX_OCCLUDERS];
+    for (int iy = 0; iy < height; iy++) {
+        double y = iy + 0.5;
+        double dy = y - v->light_y;
+        if (dy * dy > reach_squared) continue;
+        double reach = sqrt(reach_squared - dy * dy);
+        int row_first = (int)ceil(v->light_x - reach - 0.5);
+        int row_last = (int)floor(v->light_x + reach - 0.5);
+        if (row_first < 0) row_first = 0;
+        if (row_last > width - 1) row_last = width - 1;
+        if (row_first > row_last) continue;
+
+        // Pixel ix is shadowed when its centre ix + 0.5 falls inside a span
+        int num_spans = 0;
+        for (int k = 0; k < v->count; k++) {
+            double x0, x1;
+            if (!occluder_row_span(&v->occluders[k], v->light_x, v->light_y, y, &x0, &x1)) continue;
+            double first = ceil(x0 - 0.5), last = floor(x1 - 0.5);
+            if (first > row_last || last < row_first || first > last) continue;
+            spans[num_spans].first = first < row_first ? row_first : (int)first;
+            spans[num_spans].last = last > row_last ? row_last : (int)last;
+            num_spans++;
+        }
+        qsort(spans, num_spans, sizeof(spans[0]), shadow_span_compare);
+
+        Uint32 *row = pixels + iy * pitch;
+        int ix = row_first;
+        for (int k = 0; k <= num_spans; k++) {
+            int lit_last = k < num_spans ? spans[k].first - 1 : row_last;
+            for (; ix <= lit_last; ix++) {
+                double dx = ix + 0.5 - v->light_x;
+                double intensity = VISIBILITY_FALLOFF / (dx * dx + dy * dy + 1.0);
+                if (intensity > 1.0) intensity = 1.0;
+                if (intensity < VISIBILITY_CUTOFF) continue;
+                row[ix] = ((Uint32)(base_r * intensity) << 16) |
+                          ((Uint32)(base_g * intensity) << 8) |
+                          (Uint32)(base_b * intensity);
+                pixels_written++;
+            }
+            if (k < num_spans && spans[k].last + 1 > ix) ix = spans[k].last + 1;
+        }
+    }
+    return pixels_written;
+}
+
+#endif